@@ -19,6 +19,7 @@
  */
 
 #include "cx88-reg.h"
+#include "cxadc.h"
 
 #include <linux/version.h>
 #include <linux/cdev.h>
@@ -29,7 +30,17 @@
 #include <linux/uaccess.h>
 #include <linux/moduleparam.h>
 #include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/compat.h>
 #include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/scatterlist.h>
+
+#define CREATE_TRACE_POINTS
+#include "cxadc_trace.h"
 
 /*
  * From Linux 4.21, dma_alloc_coherent always returns zeroed memory,
@@ -39,6 +50,42 @@
 #define dma_zalloc_coherent dma_alloc_coherent
 #endif
 
+/* Linux 5.17 split setting the IRQ affinity hint from applying it */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 17, 0)
+#define irq_set_affinity_and_hint irq_set_affinity_hint
+#define irq_update_affinity_hint irq_set_affinity_hint
+#endif
+
+/*
+ * Architectures that can do non-coherent DMA need the caching the DMA layer
+ * picks for a user mapping, and only dma_mmap_coherent() knows it. It maps a
+ * single allocation, so the ring can only be mapped where all DMA is coherent.
+ */
+#if defined(CONFIG_ARCH_HAS_SYNC_DMA_FOR_DEVICE) || \
+	defined(CONFIG_ARCH_HAS_SYNC_DMA_FOR_CPU) || \
+	defined(CONFIG_ARCH_HAS_SYNC_DMA_FOR_CPU_ALL)
+#define CXADC_MMAP_RING		0
+#else
+#define CXADC_MMAP_RING		1
+#endif
+
+/* Linux 5.3 renamed the *_ns time getters */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 3, 0)
+#define ktime_get_boottime_ns ktime_get_boot_ns
+#endif
+
+/* compat_ptr_ioctl arrived in Linux 5.5 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 5, 0)
+#ifdef CONFIG_COMPAT
+static long compat_ptr_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	return file->f_op->unlocked_ioctl(file, cmd, (unsigned long)compat_ptr(arg));
+}
+#else
+#define compat_ptr_ioctl NULL
+#endif
+#endif
+
 #define default_latency			-1
 #define default_audsel			-1
 #define default_vmux		        1	
@@ -48,6 +95,14 @@
 #define default_sixdb			0
 #define default_crystal			28636363
 #define default_center_offset	8
+#define default_ring_size_mb	64
+#define default_irq_period_kb	2048
+#define default_dma_idle_ms		5000
+#define default_poll_us			0
+#define default_format			CXADC_FORMAT_RAW
+#define default_level_stats		0
+#define default_calibrate_ms	0
+#define default_calibrate_apply	0
 
 #define cx_read(reg)         readl(ctd->mmio + ((reg) >> 2))
 #define cx_write(reg, value) writel((value), ctd->mmio + ((reg) >> 2))
@@ -56,16 +111,70 @@
 	dev_err(&ctd->pci->dev, fmt, ##__VA_ARGS__)
 #define cx_info(fmt, ...) \
 	dev_info(&ctd->pci->dev, fmt, ##__VA_ARGS__)
+#define cx_info_ratelimited(fmt, ...) \
+	dev_info_ratelimited(&ctd->pci->dev, fmt, ##__VA_ARGS__)
+#define cx_warn_ratelimited(fmt, ...) \
+	dev_warn_ratelimited(&ctd->pci->dev, fmt, ##__VA_ARGS__)
 
-/* 64 Mbytes VBI DMA BUFF */
-#define VBI_DMA_BUFF_SIZE (1024*1024*64)
-/* corresponds to 8192 DMA pages of 4k bytes */
-#define MAX_DMA_PAGE (VBI_DMA_BUFF_SIZE/PAGE_SIZE)
+/*
+ * limits for the VBI DMA ring size, see ring_size_mb. MO_VBI_GPCNT is a
+ * 16-bit page counter that the RISC program resets at the end of the ring,
+ * so the ring can't be longer than the counter can count.
+ */
+#define MIN_RING_SIZE_MB	8
+#define MAX_RING_PAGES		65536
+#define MAX_RING_SIZE_MB	min_t(int, 256, MAX_RING_PAGES >> (20 - PAGE_SHIFT))
+
+/*
+ * The ring is allocated in physically contiguous chunks of up to
+ * MAX_DMA_CHUNK_SIZE, falling back to smaller ones if memory is fragmented.
+ * Both must be powers of 2.
+ */
+#define MAX_DMA_CHUNK_SIZE	(2*1024*1024)
+#define MIN_DMA_CHUNK_SIZE	max_t(size_t, 64*1024, PAGE_SIZE)
 
 #define CLUSTER_BUFFER_SIZE 2048
 
-/* Must be a power of 2 */
-#define IRQ_PERIOD_IN_PAGES (0x200000 >> PAGE_SHIFT)
+/* limits for the poll timer period, see poll_us */
+#define MIN_POLL_US		50
+#define MAX_POLL_US		1000000
+
+/* limits for a sample clock calibration, see calibrate_ms */
+#define MIN_CALIBRATE_MS	1000
+#define MAX_CALIBRATE_MS	60000
+
+/* limits for the interval between IRQs, see irq_period_kb. Powers of 2. */
+#define MIN_IRQ_PERIOD_KB	16
+#define MAX_IRQ_PERIOD_KB	2048
+
+/* one physically contiguous piece of the DMA ring */
+struct cxadc_dma_chunk {
+	void *virt;
+	dma_addr_t phy;
+	size_t size;
+	/* index of the chunk's first page in the ring */
+	unsigned int first_page;
+};
+
+/* progress of a sample clock calibration, see calibrate_ms */
+enum cxadc_cal_state {
+	CXADC_CAL_IDLE,
+	/* waiting for an IRQ to start measuring from */
+	CXADC_CAL_ARMED,
+	CXADC_CAL_RUNNING,
+};
+
+/* registers the parameters drive, shadowed in struct cxadc */
+enum cxadc_reg {
+	CXADC_REG_INPUT_FORMAT,
+	CXADC_REG_CAPTURE_CTRL,
+	CXADC_REG_PLL,
+	CXADC_REG_SCONV,
+	CXADC_REG_AGC_GAIN_ADJ4,
+	CXADC_REG_AGC_SYNC_TIP3,
+	CXADC_REG_GP0_IO,
+	CXADC_NR_REGS,
+};
 
 struct cxadc {
 	/* linked list */
@@ -79,8 +188,20 @@ struct cxadc {
 	struct kref refcnt;
 
 	/* locking */
-	bool in_use;
 	struct mutex lock;
+	/* open file descriptors, each a struct cxadc_reader on readers */
+	unsigned int users;
+	struct list_head readers;
+
+	/* the card is filling the ring, see dma_idle_ms */
+	bool dma_running;
+	struct delayed_work stop_work;
+
+	/* serialises moving the head between the IRQ and the poll timer */
+	spinlock_t advance_lock;
+	/* samples MO_VBI_GPCNT every poll_period while open, see poll_us */
+	struct hrtimer poll_timer;
+	ktime_t poll_period;
 
 	unsigned int    risc_inst_buff_size;
 	unsigned int	*risc_inst_virt;
@@ -88,11 +209,78 @@ struct cxadc {
 
 	wait_queue_head_t readQ;
 
-	void *pgvec_virt[MAX_DMA_PAGE+1];
-	dma_addr_t pgvec_phy[MAX_DMA_PAGE+1];
+	/* the DMA ring, ring_pages pages long, made of nr_chunks chunks */
+	unsigned int ring_pages;
+	/* the RISC program raises IRQ1 after every irq_period_pages pages */
+	unsigned int irq_period_pages;
+	unsigned int nr_chunks;
+	struct cxadc_dma_chunk *chunks;
+	/* address of each page, for quick lookups */
+	void **pgvec_virt;
+	dma_addr_t *pgvec_phy;
+	/*
+	 * Fill generation of each DMA page: 1 + the ring lap (hw_pages / ring_pages)
+	 * it was last written in, or 0 if it hasn't been written yet.
+	 */
+	u32 *page_gen;
+	/* number of live mmap()s of the ring, which must not be reallocated */
+	atomic_t mmap_count;
+
+	/* read-only page shared with mmap() users */
+	struct cxadc_mmap_status *status;
+	dma_addr_t status_phy;
 
 	atomic_t lgpcnt;
-	int initial_page;
+	/* total DMA pages completed, lgpcnt == hw_pages % ring_pages */
+	atomic64_t hw_pages;
+
+	/* ring overruns seen by all readers */
+	atomic64_t overruns;
+	atomic64_t dropped_bytes;
+
+	/* gain and offset last written to the card, and the log of changes */
+	int hw_level;
+	int hw_sixdb;
+	int hw_center_offset;
+	spinlock_t event_lock;
+	struct cxadc_event_log events;
+
+	/* level statistics of the newest block, see level_stats */
+	struct work_struct levels_work;
+	atomic64_t levels_skipped;
+	spinlock_t levels_lock;
+	struct cxadc_levels levels;
+
+	/*
+	 * Sample clock calibration: the IRQ handler notes the first and last
+	 * IRQ of the interval and cal_work works out the results.
+	 */
+	int cal_state;
+	u64 cal_start_page;
+	u64 cal_start_ns;
+	u64 cal_end_page;
+	u64 cal_end_ns;
+	struct work_struct cal_work;
+	/* last result, under lock: 0 for none yet; the rate is in milli-Hz */
+	u64 cal_rate_millihz;
+	s64 cal_ppb;
+	u64 cal_crystal;
+
+	/*
+	 * Last value written to each enum cxadc_reg register, valid where the
+	 * bit in regs_valid is set. Protected by lock, see cxadc_write_reg().
+	 */
+	u32 regs[CXADC_NR_REGS];
+	unsigned long regs_valid;
+
+	/* runtime statistics, see mycxadc_stats_group */
+	atomic64_t irqs;
+	atomic64_t irq_misses;
+	atomic64_t unexpected_irqs;
+	atomic64_t bytes_read;
+	atomic64_t wakeups;
+	atomic64_t max_lag_pages;
+
 	/* device attributes */
 	int latency;
 	int audsel;
@@ -103,8 +291,49 @@ struct cxadc {
 	int sixdb;
 	int crystal;
 	int center_offset;
+	int ring_size_mb;
+	int irq_period_kb;
+	int dma_idle_ms;
+	int poll_us;
+	int format;
+	int level_stats;
+	int calibrate_ms;
+	int calibrate_apply;
+};
+
+/* per-open state */
+struct cxadc_reader {
+	struct cxadc *ctd;
+	/* on ctd->readers */
+	struct list_head node;
+	/* reads of one fd can run in parallel, so everything below is under this */
+	struct mutex lock;
+	/* absolute byte position in the stream, see hw_pages */
+	u64 pos;
+
+	u64 overruns;
+	u64 dropped_bytes;
+
+	/* output format, see enum cxadc_format */
+	int format;
+	/* bytes per sample in the ring */
+	unsigned int sample_size;
+	/* ring bytes in and output bytes out per converted sample group */
+	unsigned int in_unit;
+	unsigned int out_unit;
+	/* converted samples, and what did not fit in the last read */
+	u8 *bounce;
+	unsigned int bounce_len;
+	u8 pending[8];
+	unsigned int pending_len;
 };
 
+/* the stores below program the card as soon as a setting changes */
+static void cxadc_apply_vmux(struct cxadc *ctd);
+static void cxadc_apply_clock(struct cxadc *ctd);
+static void cxadc_apply_audsel(struct cxadc *ctd);
+static void cxadc_set_gain(struct cxadc *ctd);
+
 /*
  * boiler plate for device attributes
  * show/store for latency
@@ -151,10 +380,17 @@ static ssize_t mycxadc_audsel_show(struct device *dev,
 static ssize_t mycxadc_audsel_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t count)
 {
-	int ret;
+	int ret, val;
 	struct cxadc *mycxadc = dev_get_drvdata(dev);
 
-	ret = kstrtoint(buf, 10, &mycxadc->audsel);
+	ret = kstrtoint(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	mutex_lock(&mycxadc->lock);
+	mycxadc->audsel = val;
+	cxadc_apply_audsel(mycxadc);
+	mutex_unlock(&mycxadc->lock);
 	return count;
 }
 
@@ -177,10 +413,17 @@ static ssize_t mycxadc_level_show(struct device *dev,
 static ssize_t mycxadc_level_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t count)
 {
-	int ret;
+	int ret, val;
 	struct cxadc *mycxadc = dev_get_drvdata(dev);
 
-	ret = kstrtoint(buf, 10, &mycxadc->level);
+	ret = kstrtoint(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	mutex_lock(&mycxadc->lock);
+	mycxadc->level = val;
+	cxadc_set_gain(mycxadc);
+	mutex_unlock(&mycxadc->lock);
 	return count;
 }
 
@@ -203,10 +446,17 @@ static ssize_t mycxadc_vmux_show(struct device *dev,
 static ssize_t mycxadc_vmux_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t count)
 {
-	int ret;
+	int ret, val;
 	struct cxadc *mycxadc = dev_get_drvdata(dev);
 
-	ret = kstrtoint(buf, 10, &mycxadc->vmux);
+	ret = kstrtoint(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	mutex_lock(&mycxadc->lock);
+	mycxadc->vmux = val;
+	cxadc_apply_vmux(mycxadc);
+	mutex_unlock(&mycxadc->lock);
 	return count;
 }
 
@@ -232,6 +482,7 @@ static ssize_t mycxadc_tenbit_store(struct device *dev,
 	int ret;
 	struct cxadc *mycxadc = dev_get_drvdata(dev);
 
+	/* takes effect the next time the device is opened */
 	ret = kstrtoint(buf, 10, &mycxadc->tenbit);
 	return count;
 }
@@ -255,10 +506,17 @@ static ssize_t mycxadc_tenxfsc_show(struct device *dev,
 static ssize_t mycxadc_tenxfsc_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t count)
 {
-	int ret;
+	int ret, val;
 	struct cxadc *mycxadc = dev_get_drvdata(dev);
 
-	ret = kstrtoint(buf, 10, &mycxadc->tenxfsc);
+	ret = kstrtoint(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	mutex_lock(&mycxadc->lock);
+	mycxadc->tenxfsc = val;
+	cxadc_apply_clock(mycxadc);
+	mutex_unlock(&mycxadc->lock);
 	return count;
 }
 
@@ -281,10 +539,19 @@ static ssize_t mycxadc_sixdb_show(struct device *dev,
 static ssize_t mycxadc_sixdb_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t count)
 {
-	int ret;
+	int ret, val;
 	struct cxadc *mycxadc = dev_get_drvdata(dev);
 
-	ret = kstrtoint(buf, 10, &mycxadc->sixdb);
+	ret = kstrtoint(buf, 10, &val);
+	if (ret)
+		return ret;
+	if (val != 0 && val != 1)
+		return -EINVAL;
+
+	mutex_lock(&mycxadc->lock);
+	mycxadc->sixdb = val;
+	cxadc_set_gain(mycxadc);
+	mutex_unlock(&mycxadc->lock);
 	return count;
 }
 
@@ -307,10 +574,20 @@ static ssize_t mycxadc_crystal_show(struct device *dev,
 static ssize_t mycxadc_crystal_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t count)
 {
-	int ret;
+	int ret, val;
 	struct cxadc *mycxadc = dev_get_drvdata(dev);
 
-	ret = kstrtoint(buf, 10, &mycxadc->crystal);
+	ret = kstrtoint(buf, 10, &val);
+	if (ret)
+		return ret;
+	/* the PLL is programmed in steps of crystal / 40 */
+	if (val < 40)
+		return -EINVAL;
+
+	mutex_lock(&mycxadc->lock);
+	mycxadc->crystal = val;
+	cxadc_apply_clock(mycxadc);
+	mutex_unlock(&mycxadc->lock);
 	return count;
 }
 
@@ -332,11 +609,292 @@ static ssize_t mycxadc_center_offset_show(struct device *dev,
 
 static ssize_t mycxadc_center_offset_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t count)
+{
+	int ret, val;
+	struct cxadc *mycxadc = dev_get_drvdata(dev);
+
+	ret = kstrtoint(buf, 10, &val);
+	if (ret)
+		return ret;
+	if (val < 0 || val > 255)
+		return -EINVAL;
+
+	mutex_lock(&mycxadc->lock);
+	mycxadc->center_offset = val;
+	cxadc_set_gain(mycxadc);
+	mutex_unlock(&mycxadc->lock);
+	return count;
+}
+
+/*
+ * show/store for ring_size_mb
+ */
+
+static ssize_t mycxadc_ring_size_mb_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct cxadc *mycxadc = dev_get_drvdata(dev);
+	int len;
+
+	len = sprintf(buf, "%d\n", mycxadc->ring_size_mb);
+	if (len <= 0)
+		dev_err(dev, "cxadc: Invalid sprintf len: %d\n", len);
+	return len;
+}
+
+static bool ring_size_valid(int mb);
+
+static ssize_t mycxadc_ring_size_mb_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	int ret, mb;
+	struct cxadc *mycxadc = dev_get_drvdata(dev);
+
+	ret = kstrtoint(buf, 10, &mb);
+	if (ret)
+		return ret;
+	if (!ring_size_valid(mb))
+		return -EINVAL;
+
+	/* takes effect the next time the device is opened */
+	mycxadc->ring_size_mb = mb;
+	return count;
+}
+
+/*
+ * show/store for irq_period_kb
+ */
+
+static ssize_t mycxadc_irq_period_kb_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct cxadc *mycxadc = dev_get_drvdata(dev);
+	int len;
+
+	len = sprintf(buf, "%d\n", mycxadc->irq_period_kb);
+	if (len <= 0)
+		dev_err(dev, "cxadc: Invalid sprintf len: %d\n", len);
+	return len;
+}
+
+static bool irq_period_valid(int kb);
+
+static ssize_t mycxadc_irq_period_kb_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	int ret, kb;
+	struct cxadc *mycxadc = dev_get_drvdata(dev);
+
+	ret = kstrtoint(buf, 10, &kb);
+	if (ret)
+		return ret;
+	if (!irq_period_valid(kb))
+		return -EINVAL;
+
+	/* takes effect the next time the device is opened */
+	mycxadc->irq_period_kb = kb;
+	return count;
+}
+
+/*
+ * show/store for dma_idle_ms
+ */
+
+static ssize_t mycxadc_dma_idle_ms_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct cxadc *mycxadc = dev_get_drvdata(dev);
+	int len;
+
+	len = sprintf(buf, "%d\n", mycxadc->dma_idle_ms);
+	if (len <= 0)
+		dev_err(dev, "cxadc: Invalid sprintf len: %d\n", len);
+	return len;
+}
+
+static ssize_t mycxadc_dma_idle_ms_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	int ret, ms;
+	struct cxadc *mycxadc = dev_get_drvdata(dev);
+
+	ret = kstrtoint(buf, 10, &ms);
+	if (ret)
+		return ret;
+	if (ms < -1)
+		return -EINVAL;
+
+	/* takes effect the next time the device is closed */
+	mycxadc->dma_idle_ms = ms;
+	return count;
+}
+
+/*
+ * show/store for poll_us
+ */
+
+static ssize_t mycxadc_poll_us_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct cxadc *mycxadc = dev_get_drvdata(dev);
+	int len;
+
+	len = sprintf(buf, "%d\n", mycxadc->poll_us);
+	if (len <= 0)
+		dev_err(dev, "cxadc: Invalid sprintf len: %d\n", len);
+	return len;
+}
+
+static ssize_t mycxadc_poll_us_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	int ret, us;
+	struct cxadc *mycxadc = dev_get_drvdata(dev);
+
+	ret = kstrtoint(buf, 10, &us);
+	if (ret)
+		return ret;
+	if (us != 0 && (us < MIN_POLL_US || us > MAX_POLL_US))
+		return -EINVAL;
+
+	/* takes effect the next time the device is opened */
+	mycxadc->poll_us = us;
+	return count;
+}
+
+/*
+ * show/store for format, by name
+ */
+
+static const char * const cxadc_format_names[] = {
+	[CXADC_FORMAT_RAW] = "raw",
+	[CXADC_FORMAT_SIGNED] = "signed",
+	[CXADC_FORMAT_RJ16] = "rj16",
+	[CXADC_FORMAT_PACKED10] = "packed10",
+};
+
+static ssize_t mycxadc_format_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct cxadc *mycxadc = dev_get_drvdata(dev);
+	int len;
+
+	len = sprintf(buf, "%s\n", cxadc_format_names[mycxadc->format]);
+	if (len <= 0)
+		dev_err(dev, "cxadc: Invalid sprintf len: %d\n", len);
+	return len;
+}
+
+static ssize_t mycxadc_format_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	int format;
+	struct cxadc *mycxadc = dev_get_drvdata(dev);
+
+	format = sysfs_match_string(cxadc_format_names, buf);
+	if (format < 0)
+		return format;
+
+	/* takes effect for readers that open the device from now on */
+	mycxadc->format = format;
+	return count;
+}
+
+/*
+ * show/store for level_stats
+ */
+
+static ssize_t mycxadc_level_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct cxadc *mycxadc = dev_get_drvdata(dev);
+	int len;
+
+	len = sprintf(buf, "%d\n", mycxadc->level_stats);
+	if (len <= 0)
+		dev_err(dev, "cxadc: Invalid sprintf len: %d\n", len);
+	return len;
+}
+
+static ssize_t mycxadc_level_stats_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	int ret;
+	bool on;
+	struct cxadc *mycxadc = dev_get_drvdata(dev);
+
+	ret = kstrtobool(buf, &on);
+	if (ret)
+		return ret;
+
+	/* the next IRQ starts or stops measuring */
+	WRITE_ONCE(mycxadc->level_stats, on);
+	return count;
+}
+
+/*
+ * show/store for calibrate_ms
+ */
+
+static ssize_t mycxadc_calibrate_ms_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct cxadc *mycxadc = dev_get_drvdata(dev);
+	int len;
+
+	len = sprintf(buf, "%d\n", mycxadc->calibrate_ms);
+	if (len <= 0)
+		dev_err(dev, "cxadc: Invalid sprintf len: %d\n", len);
+	return len;
+}
+
+static ssize_t mycxadc_calibrate_ms_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	int ret, ms;
+	struct cxadc *mycxadc = dev_get_drvdata(dev);
+
+	ret = kstrtoint(buf, 10, &ms);
+	if (ret)
+		return ret;
+	if (ms != 0 && (ms < MIN_CALIBRATE_MS || ms > MAX_CALIBRATE_MS))
+		return -EINVAL;
+
+	/* measuring starts at the next IRQ, 0 cancels it */
+	mycxadc->calibrate_ms = ms;
+	WRITE_ONCE(mycxadc->cal_state, ms ? CXADC_CAL_ARMED : CXADC_CAL_IDLE);
+	return count;
+}
+
+/*
+ * show/store for calibrate_apply
+ */
+
+static ssize_t mycxadc_calibrate_apply_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct cxadc *mycxadc = dev_get_drvdata(dev);
+	int len;
+
+	len = sprintf(buf, "%d\n", mycxadc->calibrate_apply);
+	if (len <= 0)
+		dev_err(dev, "cxadc: Invalid sprintf len: %d\n", len);
+	return len;
+}
+
+static ssize_t mycxadc_calibrate_apply_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
 {
 	int ret;
+	bool on;
 	struct cxadc *mycxadc = dev_get_drvdata(dev);
 
-	ret = kstrtoint(buf, 10, &mycxadc->center_offset);
+	ret = kstrtobool(buf, &on);
+	if (ret)
+		return ret;
+
+	/* used when the next calibration finishes */
+	mycxadc->calibrate_apply = on;
 	return count;
 }
 
@@ -421,27 +979,229 @@ static struct device_attribute dev_attr_center_offset = {
 	.store = mycxadc_center_offset_store,
 };
 
-static struct attribute *mycxadc_attrs[] = {
-	&dev_attr_latency.attr,
-	&dev_attr_audsel.attr,
-	&dev_attr_vmux.attr,
-	&dev_attr_level.attr,
-	&dev_attr_tenbit.attr,
-	&dev_attr_tenxfsc.attr,
-	&dev_attr_sixdb.attr,
-	&dev_attr_crystal.attr,
-	&dev_attr_center_offset.attr,
-	NULL
+static struct device_attribute dev_attr_ring_size_mb = {
+	.attr = {
+		.name = "ring_size_mb",
+		.mode = 0664,
+	},
+	.show = mycxadc_ring_size_mb_show,
+	.store = mycxadc_ring_size_mb_store,
 };
 
-static struct attribute_group mycxadc_group = {
-	.name = "parameters",
-	.attrs = mycxadc_attrs,
+static struct device_attribute dev_attr_irq_period_kb = {
+	.attr = {
+		.name = "irq_period_kb",
+		.mode = 0664,
+	},
+	.show = mycxadc_irq_period_kb_show,
+	.store = mycxadc_irq_period_kb_store,
 };
 
-/*
- * end boiler plate
- */
+static struct device_attribute dev_attr_dma_idle_ms = {
+	.attr = {
+		.name = "dma_idle_ms",
+		.mode = 0664,
+	},
+	.show = mycxadc_dma_idle_ms_show,
+	.store = mycxadc_dma_idle_ms_store,
+};
+
+static struct device_attribute dev_attr_poll_us = {
+	.attr = {
+		.name = "poll_us",
+		.mode = 0664,
+	},
+	.show = mycxadc_poll_us_show,
+	.store = mycxadc_poll_us_store,
+};
+
+static struct device_attribute dev_attr_format = {
+	.attr = {
+		.name = "format",
+		.mode = 0664,
+	},
+	.show = mycxadc_format_show,
+	.store = mycxadc_format_store,
+};
+
+static struct device_attribute dev_attr_level_stats = {
+	.attr = {
+		.name = "level_stats",
+		.mode = 0664,
+	},
+	.show = mycxadc_level_stats_show,
+	.store = mycxadc_level_stats_store,
+};
+
+static struct device_attribute dev_attr_calibrate_ms = {
+	.attr = {
+		.name = "calibrate_ms",
+		.mode = 0664,
+	},
+	.show = mycxadc_calibrate_ms_show,
+	.store = mycxadc_calibrate_ms_store,
+};
+
+static struct device_attribute dev_attr_calibrate_apply = {
+	.attr = {
+		.name = "calibrate_apply",
+		.mode = 0664,
+	},
+	.show = mycxadc_calibrate_apply_show,
+	.store = mycxadc_calibrate_apply_store,
+};
+
+static struct attribute *mycxadc_attrs[] = {
+	&dev_attr_latency.attr,
+	&dev_attr_audsel.attr,
+	&dev_attr_vmux.attr,
+	&dev_attr_level.attr,
+	&dev_attr_tenbit.attr,
+	&dev_attr_tenxfsc.attr,
+	&dev_attr_sixdb.attr,
+	&dev_attr_crystal.attr,
+	&dev_attr_center_offset.attr,
+	&dev_attr_ring_size_mb.attr,
+	&dev_attr_irq_period_kb.attr,
+	&dev_attr_dma_idle_ms.attr,
+	&dev_attr_poll_us.attr,
+	&dev_attr_format.attr,
+	&dev_attr_level_stats.attr,
+	&dev_attr_calibrate_ms.attr,
+	&dev_attr_calibrate_apply.attr,
+	NULL
+};
+
+static struct attribute_group mycxadc_group = {
+	.name = "parameters",
+	.attrs = mycxadc_attrs,
+};
+
+/*
+ * read-only statistics, each an atomic64_t in struct cxadc
+ */
+
+#define CXADC_STAT_ATTR(_name)						\
+static ssize_t mycxadc_##_name##_show(struct device *dev,		\
+		struct device_attribute *attr, char *buf)		\
+{									\
+	struct cxadc *mycxadc = dev_get_drvdata(dev);			\
+									\
+	return sprintf(buf, "%llu\n",					\
+		(unsigned long long)atomic64_read(&mycxadc->_name));	\
+}									\
+									\
+static struct device_attribute dev_attr_##_name = {			\
+	.attr = {							\
+		.name = #_name,						\
+		.mode = 0444,						\
+	},								\
+	.show = mycxadc_##_name##_show,					\
+}
+
+CXADC_STAT_ATTR(overruns);
+CXADC_STAT_ATTR(dropped_bytes);
+CXADC_STAT_ATTR(irqs);
+CXADC_STAT_ATTR(irq_misses);
+CXADC_STAT_ATTR(unexpected_irqs);
+CXADC_STAT_ATTR(bytes_read);
+CXADC_STAT_ATTR(wakeups);
+CXADC_STAT_ATTR(max_lag_pages);
+
+/*
+ * store for reset, zeroes all of the statistics
+ */
+
+static ssize_t mycxadc_reset_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	int ret;
+	bool reset;
+	struct cxadc *mycxadc = dev_get_drvdata(dev);
+
+	ret = kstrtobool(buf, &reset);
+	if (ret)
+		return ret;
+
+	if (reset) {
+		atomic64_set(&mycxadc->overruns, 0);
+		atomic64_set(&mycxadc->dropped_bytes, 0);
+		atomic64_set(&mycxadc->irqs, 0);
+		atomic64_set(&mycxadc->irq_misses, 0);
+		atomic64_set(&mycxadc->unexpected_irqs, 0);
+		atomic64_set(&mycxadc->bytes_read, 0);
+		atomic64_set(&mycxadc->wakeups, 0);
+		atomic64_set(&mycxadc->max_lag_pages, 0);
+	}
+	return count;
+}
+
+static struct device_attribute dev_attr_reset = {
+	.attr = {
+		.name = "reset",
+		.mode = 0200,
+	},
+	.store = mycxadc_reset_store,
+};
+
+/*
+ * show for calibration: measured sample clock in Hz, its error in ppm and
+ * the crystal frequency that would give it, or "none"
+ */
+
+static ssize_t mycxadc_calibration_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct cxadc *mycxadc = dev_get_drvdata(dev);
+	u32 rate_frac, ppb_frac;
+	u64 rate, ppb;
+	int len;
+
+	mutex_lock(&mycxadc->lock);
+	if (!mycxadc->cal_rate_millihz) {
+		len = sprintf(buf, "none\n");
+	} else {
+		rate = div_u64_rem(mycxadc->cal_rate_millihz, 1000, &rate_frac);
+		ppb = div_u64_rem(abs(mycxadc->cal_ppb), 1000, &ppb_frac);
+		len = sprintf(buf, "%llu.%03u %s%llu.%03u %llu\n",
+			(unsigned long long)rate, rate_frac,
+			mycxadc->cal_ppb < 0 ? "-" : "", (unsigned long long)ppb, ppb_frac,
+			(unsigned long long)mycxadc->cal_crystal);
+	}
+	mutex_unlock(&mycxadc->lock);
+	return len;
+}
+
+static struct device_attribute dev_attr_calibration = {
+	.attr = {
+		.name = "calibration",
+		.mode = 0444,
+	},
+	.show = mycxadc_calibration_show,
+};
+
+static struct attribute *mycxadc_stats_attrs[] = {
+	&dev_attr_overruns.attr,
+	&dev_attr_dropped_bytes.attr,
+	&dev_attr_irqs.attr,
+	&dev_attr_irq_misses.attr,
+	&dev_attr_unexpected_irqs.attr,
+	&dev_attr_bytes_read.attr,
+	&dev_attr_wakeups.attr,
+	&dev_attr_max_lag_pages.attr,
+	&dev_attr_reset.attr,
+	&dev_attr_calibration.attr,
+	NULL
+};
+
+static struct attribute_group mycxadc_stats_group = {
+	.name = "stats",
+	.attrs = mycxadc_stats_attrs,
+};
+
+/*
+ * end boiler plate
+ */
 
 static struct cxadc *cxadcs;
 static unsigned int cxcount;
@@ -453,6 +1213,13 @@ static unsigned int cxcount;
 static struct class *cxadc_class;
 static int cxadc_major;
 
+/* serialises CXADC_IOC_GROUP_START across cards */
+static DEFINE_MUTEX(cxadc_group_lock);
+
+static int ring_size_mb = default_ring_size_mb;
+module_param(ring_size_mb, int, 0444);
+MODULE_PARM_DESC(ring_size_mb, "default size of each card's DMA ring in MiB (8-256, even)");
+
 #define NUMBER_OF_CLUSTER_BUFFER 8
 #define CX_SRAM_BASE	0x180000
 
@@ -463,6 +1230,13 @@ static int cxadc_major;
 #define CHN24_CMDS_BASE		0x180100
 #define DMA_BUFFER_SIZE		(256*1024)
 
+/*
+ * MO_VBI_GPCNT can run ahead of the pages that have reached memory by up to
+ * the FIFO's worth of clusters, so the poll timer stays this far behind it.
+ */
+#define POLL_MARGIN_PAGES \
+	(DIV_ROUND_UP(NUMBER_OF_CLUSTER_BUFFER * CLUSTER_BUFFER_SIZE, PAGE_SIZE) + 1)
+
 #define INTERRUPT_MASK	0x18888
 
 static struct pci_device_id cxadc_pci_tbl[] = {
@@ -490,6 +1264,34 @@ static void disable_card(struct cxadc *ctd)
 	cx_write(MO_DEV_CNTRL2, 0);
 }
 
+/* point the DMA channel at the start of the RISC program and run it */
+static void cxadc_start_dma(struct cxadc *ctd)
+{
+	/* no ring to fill if reallocating it failed */
+	if (!ctd->ring_pages)
+		return;
+
+	cx_write(CHN24_CMDS_BASE, ctd->risc_inst_phy); /* working */
+	cx_write(CHN24_CMDS_BASE+4, CDT_BASE);
+	cx_write(CHN24_CMDS_BASE+8, 2*NUMBER_OF_CLUSTER_BUFFER);
+	cx_write(CHN24_CMDS_BASE+12, RISC_INST_QUEUE);
+
+	cx_write(CHN24_CMDS_BASE+16, 0x40);
+
+	/* run risc */
+	cx_write(MO_DEV_CNTRL2, 1<<5);
+	/* enable fifo and risc */
+	cx_write(MO_VID_DMACNTRL, ((1<<7)|(1<<3)));
+}
+
+static void cxadc_stop_dma(struct cxadc *ctd)
+{
+	/* disable fifo and risc */
+	cx_write(MO_VID_DMACNTRL, 0);
+	/* disable risc */
+	cx_write(MO_DEV_CNTRL2, 0);
+}
+
 /*
  * numbuf   - number of buffer
  * buffsize - buffer size in bytes
@@ -526,20 +1328,109 @@ static void create_cdt_table(struct cxadc *ctd,
 
 }
 
+static bool ring_size_valid(int mb)
+{
+	/* the ring must hold a whole number of the longest IRQ periods */
+	return mb >= MIN_RING_SIZE_MB && mb <= MAX_RING_SIZE_MB &&
+		((mb << 10) % MAX_IRQ_PERIOD_KB) == 0;
+}
+
+static bool irq_period_valid(int kb)
+{
+	/* IRQ1 can only be raised at the end of a DMA page */
+	return kb >= MIN_IRQ_PERIOD_KB && kb <= MAX_IRQ_PERIOD_KB &&
+		is_power_of_2(kb) && ((unsigned long)kb << 10) >= PAGE_SIZE;
+}
+
+/* position of absolute page number page within the ring */
+static unsigned int cxadc_ring_index(struct cxadc *ctd, u64 page)
+{
+	u32 index;
+
+	div_u64_rem(page, ctd->ring_pages, &index);
+	return index;
+}
+
 static void free_dma_buffer(struct cxadc *ctd)
 {
-	int i;
+	unsigned int i;
+
+	for (i = 0; i < ctd->nr_chunks; i++) {
+		struct cxadc_dma_chunk *chunk = &ctd->chunks[i];
+
+		dma_free_coherent(&ctd->pci->dev, chunk->size, chunk->virt, chunk->phy);
+	}
+
+	kvfree(ctd->chunks);
+	ctd->chunks = NULL;
+	ctd->nr_chunks = 0;
+
+	kvfree(ctd->pgvec_virt);
+	kvfree(ctd->pgvec_phy);
+	kvfree(ctd->page_gen);
+	ctd->pgvec_virt = NULL;
+	ctd->pgvec_phy = NULL;
+	ctd->page_gen = NULL;
+}
+
+static int alloc_dma_buffer(struct cxadc *ctd)
+{
+	size_t ring_size = (size_t)ctd->ring_pages << PAGE_SHIFT;
+	size_t chunk_size = MAX_DMA_CHUNK_SIZE;
+	int node = dev_to_node(&ctd->pci->dev);
+	unsigned int page = 0;
+	unsigned int i;
+
+	/*
+	 * The chunks themselves come from the card's NUMA node through the DMA
+	 * API. Keep the tables the IRQ and readers walk there too.
+	 */
+	ctd->chunks = kvzalloc_node(array_size(DIV_ROUND_UP(ring_size, MIN_DMA_CHUNK_SIZE),
+					       sizeof(*ctd->chunks)), GFP_KERNEL, node);
+	ctd->pgvec_virt = kvzalloc_node(array_size(ctd->ring_pages, sizeof(*ctd->pgvec_virt)),
+					GFP_KERNEL, node);
+	ctd->pgvec_phy = kvzalloc_node(array_size(ctd->ring_pages, sizeof(*ctd->pgvec_phy)),
+				       GFP_KERNEL, node);
+	ctd->page_gen = kvzalloc_node(array_size(ctd->ring_pages, sizeof(*ctd->page_gen)),
+				      GFP_KERNEL, node);
+	if (!ctd->chunks || !ctd->pgvec_virt || !ctd->pgvec_phy || !ctd->page_gen)
+		return -ENOMEM;
+
+	while (page < ctd->ring_pages) {
+		struct cxadc_dma_chunk *chunk = &ctd->chunks[ctd->nr_chunks];
+		size_t size = min_t(size_t, chunk_size, ring_size - ((size_t)page << PAGE_SHIFT));
+
+		chunk->virt = dma_zalloc_coherent(&ctd->pci->dev, size, &chunk->phy,
+				GFP_KERNEL | __GFP_NOWARN);
+		if (chunk->virt == NULL) {
+			/* try again with a smaller chunk */
+			if (chunk_size > MIN_DMA_CHUNK_SIZE) {
+				chunk_size >>= 1;
+				continue;
+			}
+			cx_err("alloc dma buffer failed. index = %u\n", page);
+			return -ENOMEM;
+		}
+		chunk->size = size;
+		chunk->first_page = page;
+		ctd->nr_chunks++;
 
-	for (i = 0; i < MAX_DMA_PAGE; i++) {
-		if (ctd->pgvec_virt[i])
-			dma_free_coherent(&ctd->pci->dev, PAGE_SIZE, ctd->pgvec_virt[i], ctd->pgvec_phy[i]);
+		for (i = 0; i < (size >> PAGE_SHIFT); i++, page++) {
+			ctd->pgvec_virt[page] = chunk->virt + ((size_t)i << PAGE_SHIFT);
+			ctd->pgvec_phy[page] = chunk->phy + ((dma_addr_t)i << PAGE_SHIFT);
+		}
 	}
+
+	cx_info("total DMA size allocated = %lu kb in %u chunks\n",
+		(unsigned long)(ring_size / 1024), ctd->nr_chunks);
+
+	return 0;
 }
 
 static int alloc_risc_inst_buffer(struct cxadc *ctd)
 {
 	/* add 1 page for sync instruct and jump */
-	ctd->risc_inst_buff_size = (VBI_DMA_BUFF_SIZE/CLUSTER_BUFFER_SIZE)*8+PAGE_SIZE;
+	ctd->risc_inst_buff_size = (ctd->ring_pages * (PAGE_SIZE/CLUSTER_BUFFER_SIZE))*8+PAGE_SIZE;
 	ctd->risc_inst_virt = dma_alloc_coherent(&ctd->pci->dev, ctd->risc_inst_buff_size, &ctd->risc_inst_phy, GFP_KERNEL);
 	if (ctd->risc_inst_virt == NULL)
 		return -ENOMEM;
@@ -555,6 +1446,31 @@ static void free_risc_inst_buffer(struct cxadc *ctd)
 {
 	if (ctd->risc_inst_virt != NULL)
 		dma_free_coherent(&ctd->pci->dev, ctd->risc_inst_buff_size, ctd->risc_inst_virt, ctd->risc_inst_phy);
+	ctd->risc_inst_virt = NULL;
+}
+
+static int alloc_status_page(struct cxadc *ctd)
+{
+	BUILD_BUG_ON(sizeof(struct cxadc_mmap_status) > PAGE_SIZE);
+
+	/* allocated like the ring so both can be mapped the same way */
+	ctd->status = dma_zalloc_coherent(&ctd->pci->dev, PAGE_SIZE, &ctd->status_phy, GFP_KERNEL);
+	if (ctd->status == NULL)
+		return -ENOMEM;
+
+	ctd->status->version = CXADC_MMAP_STATUS_VERSION;
+	ctd->status->page_size = PAGE_SIZE;
+	ctd->status->lgpcnt = -1;
+	ctd->status->irq_period_pages = ctd->irq_period_pages;
+	ctd->status->timestamp_log_size = CXADC_TIMESTAMP_LOG_SIZE;
+
+	return 0;
+}
+
+static void free_status_page(struct cxadc *ctd)
+{
+	if (ctd->status != NULL)
+		dma_free_coherent(&ctd->pci->dev, PAGE_SIZE, ctd->status, ctd->status_phy);
 }
 
 static int make_risc_instructions(struct cxadc *ctd)
@@ -568,7 +1484,7 @@ static int make_risc_instructions(struct cxadc *ctd)
 
 	*pp++ = RISC_SYNC|RISC_CNT_RESET;
 
-	for (page = 0; page < MAX_DMA_PAGE; page++) {
+	for (page = 0; page < ctd->ring_pages; page++) {
 		dma_addr = ctd->pgvec_phy[page];
 
 		/* Each WRITE is CLUSTER_BUFFER_SIZE bytes so each DMA page requires
@@ -584,9 +1500,9 @@ static int make_risc_instructions(struct cxadc *ctd)
 		/* Generate the final write which may trigger side effects. */
 		*pp++ = RISC_WRITE|CLUSTER_BUFFER_SIZE|RISC_SOL|RISC_EOL|
 			/* If this is the last DMA page, reset counter, otherwise increment it. */
-			(page == (MAX_DMA_PAGE - 1) ? RISC_CNT_RESET : RISC_CNT_INC)|
+			(page == (ctd->ring_pages - 1) ? RISC_CNT_RESET : RISC_CNT_INC)|
 			/* If we've filled enough pages, trigger IRQ1. */
-			((((page + 1) % IRQ_PERIOD_IN_PAGES) == 0) ? RISC_IRQ1 : 0);
+			((((page + 1) % ctd->irq_period_pages) == 0) ? RISC_IRQ1 : 0);
 		*pp++ = dma_addr;
 	}
 
@@ -598,75 +1514,238 @@ static int make_risc_instructions(struct cxadc *ctd)
 	return 0;
 }
 
-static int cxadc_char_open(struct inode *inode, struct file *file)
+static void free_ring(struct cxadc *ctd)
 {
-	int minor = iminor(inode);
-	struct cxadc *ctd = container_of(inode->i_cdev, struct cxadc, cdev);
-	unsigned long longtenxfsc, longPLLboth, longPLLint;
-	int PLLint, PLLfrac, PLLfin, SConv, rv;
+	free_dma_buffer(ctd);
+	free_risc_inst_buffer(ctd);
+	ctd->ring_pages = 0;
+	ctd->status->ring_pages = 0;
+}
 
-	for (ctd = cxadcs; ctd != NULL; ctd = ctd->next)
-		if (MINOR(ctd->cdev.dev) == minor)
-			break;
-	if (ctd == NULL)
-		return -ENODEV;
+/* allocate a DMA ring of pages pages and the RISC program that fills it */
+static int alloc_ring(struct cxadc *ctd, unsigned int pages)
+{
+	int rc;
 
-	mutex_lock(&ctd->lock);
-	if (ctd->in_use) {
-		mutex_unlock(&ctd->lock);
-		return -EBUSY;
+	ctd->ring_pages = pages;
+
+	rc = alloc_risc_inst_buffer(ctd);
+	if (!rc)
+		rc = alloc_dma_buffer(ctd);
+	if (rc) {
+		free_ring(ctd);
+		return rc;
 	}
 
-	kref_get(&ctd->refcnt);
-	file->private_data = ctd;
+	make_risc_instructions(ctd);
+	ctd->status->ring_pages = pages;
+
+	return 0;
+}
+
+/*
+ * Start a running calibration again from the next IRQ, because the page
+ * count is about to stop following the card.
+ */
+static void cxadc_cal_restart(struct cxadc *ctd)
+{
+	cmpxchg(&ctd->cal_state, CXADC_CAL_RUNNING, CXADC_CAL_ARMED);
+}
+
+/*
+ * The RISC program restarts at page 0 of the ring, so move hw_pages on to
+ * the next lap boundary. Call with the DMA stopped.
+ */
+static u64 cxadc_rewind(struct cxadc *ctd)
+{
+	u64 hw_pages = atomic64_read(&ctd->hw_pages) + ctd->ring_pages - 1;
+
+	/*
+	 * Zero MO_VBI_GPCNT rather than wait for the RISC program to, so the
+	 * first read after the start can't see the last capture's count. The
+	 * read back makes sure the reset has landed before the DMA starts.
+	 */
+	cx_write(MO_VBI_GPCNTRL, GP_COUNT_CONTROL_RESET);
+	cx_read(MO_VBI_GPCNT);
+
+	cxadc_cal_restart(ctd);
+	hw_pages = div_u64(hw_pages, ctd->ring_pages) * ctd->ring_pages;
+	atomic64_set(&ctd->hw_pages, hw_pages);
+	atomic_set(&ctd->lgpcnt, -1);
+	WRITE_ONCE(ctd->status->hw_pages, hw_pages);
+	WRITE_ONCE(ctd->status->lgpcnt, -1);
+	return hw_pages;
+}
+
+/*
+ * Reallocate the ring if ring_size_mb has changed, and rebuild the RISC
+ * program if irq_period_kb has. Called from open with the device otherwise
+ * idle.
+ */
+static int cxadc_update_ring(struct cxadc *ctd)
+{
+	unsigned int pages = ctd->ring_size_mb << (20 - PAGE_SHIFT);
+	unsigned int period = (ctd->irq_period_kb << 10) >> PAGE_SHIFT;
+	unsigned int old_pages = ctd->ring_pages;
+	int rc = 0;
+
+	if (pages == old_pages && period == ctd->irq_period_pages)
+		return 0;
+
+	if (pages != old_pages && atomic_read(&ctd->mmap_count)) {
+		cx_err("ring is still mapped, not resizing it\n");
+		if (!old_pages)
+			return -EBUSY;
+		if (period == ctd->irq_period_pages)
+			return 0;
+		pages = old_pages;
+	}
+
+	/* keep the (shared) IRQ handler away from the ring while we swap it */
+	cx_write(MO_VID_INTMSK, 0);
+	synchronize_irq(ctd->irq);
+	cxadc_stop_dma(ctd);
+	/* the levels work walks the ring, and works in irq_period_pages blocks */
+	cancel_work_sync(&ctd->levels_work);
+
+	ctd->irq_period_pages = period;
+	if (pages != old_pages) {
+		free_ring(ctd);
+		rc = alloc_ring(ctd, pages);
+		if (rc && old_pages) {
+			cx_err("cannot alloc %d MiB ring, keeping the old size\n", ctd->ring_size_mb);
+			ctd->ring_size_mb = (old_pages << PAGE_SHIFT) >> 20;
+			rc = alloc_ring(ctd, old_pages);
+		}
+	} else {
+		make_risc_instructions(ctd);
+	}
+	ctd->status->irq_period_pages = ctd->irq_period_pages;
+
+	if (!rc && ctd->dma_running) {
+		cxadc_rewind(ctd);
+		cxadc_start_dma(ctd);
+	}
+
+	cx_write(MO_VID_INTMSK, INTERRUPT_MASK);
+	return rc;
+}
+
+/* start filling the ring, unless the card is still warm from the last open */
+static void cxadc_dma_on(struct cxadc *ctd)
+{
+	if (ctd->dma_running)
+		return;
+
+	cxadc_rewind(ctd);
+	cxadc_start_dma(ctd);
+	ctd->dma_running = true;
+}
+
+/* stop filling the ring once the device has been closed for dma_idle_ms */
+static void cxadc_stop_work(struct work_struct *work)
+{
+	struct cxadc *ctd = container_of(to_delayed_work(work), struct cxadc, stop_work);
 
-	ctd->in_use = true;
+	mutex_lock(&ctd->lock);
+	if (!ctd->users && ctd->dma_running) {
+		cx_write(MO_PCI_INTMSK, 0);
+		cxadc_stop_dma(ctd);
+		ctd->dma_running = false;
+	}
 	mutex_unlock(&ctd->lock);
+}
+
+/* the page the card is filling right now, counted like hw_pages */
+static u64 cxadc_card_page(struct cxadc *ctd)
+{
+	unsigned long flags;
+	int gp_cnt, last_cnt;
+	u64 page;
+
+	spin_lock_irqsave(&ctd->advance_lock, flags);
+	gp_cnt = cx_read(MO_VBI_GPCNT);
+	last_cnt = atomic_read(&ctd->lgpcnt);
+	page = atomic64_read(&ctd->hw_pages);
+	if (last_cnt != -1 && ctd->ring_pages)
+		page += (gp_cnt - last_cnt + ctd->ring_pages) % ctd->ring_pages;
+	spin_unlock_irqrestore(&ctd->advance_lock, flags);
+
+	return page;
+}
+
+static const u32 cxadc_reg_addr[CXADC_NR_REGS] = {
+	[CXADC_REG_INPUT_FORMAT]	= MO_INPUT_FORMAT,
+	[CXADC_REG_CAPTURE_CTRL]	= MO_CAPTURE_CTRL,
+	[CXADC_REG_PLL]			= MO_PLL_REG,
+	[CXADC_REG_SCONV]		= MO_SCONV_REG,
+	[CXADC_REG_AGC_GAIN_ADJ4]	= MO_AGC_GAIN_ADJ4,
+	[CXADC_REG_AGC_SYNC_TIP3]	= MO_AGC_SYNC_TIP3,
+	[CXADC_REG_GP0_IO]		= MO_GP0_IO,
+};
 
+/* write a shadowed register, unless it already holds val */
+static void cxadc_write_reg(struct cxadc *ctd, enum cxadc_reg reg, u32 val)
+{
+	if ((ctd->regs_valid & BIT(reg)) && ctd->regs[reg] == val)
+		return;
+	cx_write(cxadc_reg_addr[reg], val);
+	ctd->regs[reg] = val;
+	ctd->regs_valid |= BIT(reg);
+}
+
+static void cxadc_apply_vmux(struct cxadc *ctd)
+{
 	/* source select (see datasheet on how to change adc source) */
 	ctd->vmux &= 3;/* default vmux=1 */
 	/* pal-B */
-	cx_write(MO_INPUT_FORMAT, (ctd->vmux<<14)|(1<<13)|0x01|0x10|0x10000);
+	cxadc_write_reg(ctd, CXADC_REG_INPUT_FORMAT, (ctd->vmux<<14)|(1<<13)|0x01|0x10|0x10000);
+}
+
+/* whether the card is capturing 16-bit samples; ctd->tenbit waits for open */
+static bool cxadc_hw_tenbit(struct cxadc *ctd)
+{
+	return READ_ONCE(ctd->regs[CXADC_REG_CAPTURE_CTRL]) & (1<<5);
+}
 
+static void cxadc_apply_tenbit(struct cxadc *ctd)
+{
 	/* capture 16 bit or 8 bit raw samples */
 	if (ctd->tenbit)
-		cx_write(MO_CAPTURE_CTRL, ((1<<6)|(3<<1)|(1<<5)));
+		cxadc_write_reg(ctd, CXADC_REG_CAPTURE_CTRL, ((1<<6)|(3<<1)|(1<<5)));
 	else
-		cx_write(MO_CAPTURE_CTRL, ((1<<6)|(3<<1)|(0<<5)));
-
-	/* re-set the level, clock speed, and bit size */
+		cxadc_write_reg(ctd, CXADC_REG_CAPTURE_CTRL, ((1<<6)|(3<<1)|(0<<5)));
+}
 
-	if (ctd->level < 0)
-		ctd->level = 0;
-	if (ctd->level > 31)
-		ctd->level = 31;
-	/* control gain also bit 16 */
-	cx_write(MO_AGC_GAIN_ADJ4, (ctd->sixdb<<23)|(0<<22)|(0<<21)|(ctd->level<<16)|(0xff<<8)|(0x0<<0));
-	cx_write(MO_AGC_SYNC_TIP3, (0x1e48<<16)|(0xff<<8)|(ctd->center_offset));
+/* set the sample clock from tenxfsc and crystal */
+static void cxadc_apply_clock(struct cxadc *ctd)
+{
+	unsigned long longtenxfsc, longPLLboth, longPLLint;
+	int PLLint, PLLfrac, PLLfin, SConv;
 
 	if (ctd->tenxfsc < 10) {
 		//old code for old parameter compatibility
 		switch (ctd->tenxfsc) {
 		case 0:
 			/* clock speed equal to crystal speed, unmodified card = 28.6 mhz */
-			cx_write(MO_SCONV_REG, 131072); /* set SRC to 8xfsc */
-			cx_write(MO_PLL_REG, 0x11000000); /* set PLL to 1:1 */
+			cxadc_write_reg(ctd, CXADC_REG_SCONV, 131072); /* set SRC to 8xfsc */
+			cxadc_write_reg(ctd, CXADC_REG_PLL, 0x11000000); /* set PLL to 1:1 */
 			break;
 		case 1:
 			/* clock speed equal to 1.25 x crystal speed, unmodified card = 35.8 mhz */
-			cx_write(MO_SCONV_REG, 131072*4/5); /* set SRC to 1.25x/10fsc */
-			cx_write(MO_PLL_REG, 0x01400000); /* set PLL to 1.25x/10fsc */
+			cxadc_write_reg(ctd, CXADC_REG_SCONV, 131072*4/5); /* set SRC to 1.25x/10fsc */
+			cxadc_write_reg(ctd, CXADC_REG_PLL, 0x01400000); /* set PLL to 1.25x/10fsc */
 			break;
 		case 2:
 			/* clock speed equal to ~1.4 x crystal speed, unmodified card = 40 mhz */
-			cx_write(MO_SCONV_REG, 131072*0.715909072483);
-			cx_write(MO_PLL_REG, 0x0165965A); /* 40000000.1406459 */
+			cxadc_write_reg(ctd, CXADC_REG_SCONV, 131072*0.715909072483);
+			cxadc_write_reg(ctd, CXADC_REG_PLL, 0x0165965A); /* 40000000.1406459 */
 			break;
 		default:
 			/* if someone sets value out of range, default to crystal speed */
 			/* clock speed equal to crystal speed, unmodified card = 28.6 mhz */
-			cx_write(MO_SCONV_REG, 131072); /* set SRC to 8xfsc */
-			cx_write(MO_PLL_REG, 0x11000000); /* set PLL to 1:1 */
+			cxadc_write_reg(ctd, CXADC_REG_SCONV, 131072); /* set SRC to 8xfsc */
+			cxadc_write_reg(ctd, CXADC_REG_PLL, 0x11000000); /* set PLL to 1:1 */
 		}
 	} else {
 		if (ctd->tenxfsc < 100)
@@ -681,151 +1760,1215 @@ static int cxadc_char_open(struct inode *inode, struct file *file)
 			PLLfin = 81788928; // 81788928 lowest possible value
 		if (PLLfin > 119537664)
 			PLLfin = 119537664 ; //133169152 is highest possible value with PLL_PRE = 5 but above 119537664 may crash
-		cx_write(MO_PLL_REG,  PLLfin);
-		//cx_write(MO_SCONV_REG, 131072 * (crystal / tenxfsc));
+		cxadc_write_reg(ctd, CXADC_REG_PLL, PLLfin);
 		SConv = (long)(131072 * (long)ctd->crystal) / (long)ctd->tenxfsc;
-		cx_write(MO_SCONV_REG, SConv);
+		cxadc_write_reg(ctd, CXADC_REG_SCONV, SConv);
 	}
+}
 
+static void cxadc_apply_audsel(struct cxadc *ctd)
+{
+	if (ctd->audsel == -1)
+		return;
+	/*
+	 * Pixelview PlayTVPro Ultracard specific
+	 * select which output is redirected to audio output jack
+	 * GPIO bit 3 is to enable 4052 , bit 0-1 4052's AB
+	 */
+	cx_write(MO_GP3_IO, 1<<25); /* use as 24 bit GPIO/GPOE */
+	cx_write(MO_GP1_IO, 0x0b);
+	cxadc_write_reg(ctd, CXADC_REG_GP0_IO, ctd->audsel&3);
+}
 
-	/* capture 16 bit or 8 bit raw samples */
-	if (ctd->tenbit)
-		cx_write(MO_CAPTURE_CTRL, ((1<<6)|(3<<1)|(1<<5)));
-	else
-		cx_write(MO_CAPTURE_CTRL, ((1<<6)|(3<<1)|(0<<5)));
-
-	file->private_data = ctd;
+/* program the gain (level and sixdb) and DC offset */
+static void cxadc_write_gain(struct cxadc *ctd)
+{
+	if (ctd->level < 0)
+		ctd->level = 0;
+	if (ctd->level > 31)
+		ctd->level = 31;
+
+	/* control gain also bit 16 */
+	cxadc_write_reg(ctd, CXADC_REG_AGC_GAIN_ADJ4,
+		(ctd->sixdb<<23)|(0<<22)|(0<<21)|(ctd->level<<16)|(0xff<<8)|(0x0<<0));
+	cxadc_write_reg(ctd, CXADC_REG_AGC_SYNC_TIP3, (0x1e48<<16)|(0xff<<8)|(ctd->center_offset));
+}
+
+/*
+ * Program the gain and DC offset, and log any change to them with where in
+ * the stream it happened, see CXADC_IOC_GET_EVENTS. Called with ctd->lock
+ * held.
+ */
+static void cxadc_set_gain(struct cxadc *ctd)
+{
+	struct cxadc_event *ev;
+	u64 seq;
+
+	cxadc_write_gain(ctd);
+
+	spin_lock_irq(&ctd->event_lock);
+	if (ctd->level == ctd->hw_level && ctd->sixdb == ctd->hw_sixdb &&
+	    ctd->center_offset == ctd->hw_center_offset) {
+		spin_unlock_irq(&ctd->event_lock);
+		return;
+	}
+	ctd->hw_level = ctd->level;
+	ctd->hw_sixdb = ctd->sixdb;
+	ctd->hw_center_offset = ctd->center_offset;
+
+	seq = ++ctd->events.seq;
+	ev = &ctd->events.entries[(seq - 1) % CXADC_EVENT_LOG_SIZE];
+	ev->seq = seq;
+	ev->page = cxadc_card_page(ctd);
+	ev->time_ns = ktime_get_boottime_ns();
+	ev->level = ctd->level;
+	ev->sixdb = ctd->sixdb;
+	ev->center_offset = ctd->center_offset;
+	spin_unlock_irq(&ctd->event_lock);
+}
+
+/* the ADC clock tenxfsc and crystal are meant to give, in Hz */
+static u64 cxadc_nominal_rate(struct cxadc *ctd)
+{
+	switch (ctd->tenxfsc) {
+	case 1:
+		return div_u64((u64)ctd->crystal * 5, 4);
+	case 2:
+		/* 40 MHz from the stock 28636363 Hz crystal */
+		return div_u64((u64)ctd->crystal * 40000000, 28636363);
+	}
+	/* cxadc_apply_clock() has already turned 10-99 into Hz */
+	if (ctd->tenxfsc >= 10)
+		return ctd->tenxfsc;
+	return ctd->crystal;
+}
+
+/*
+ * Work out the ADC clock from a calibration interval. The card writes one
+ * byte per clock in both 8 and 16-bit modes, so the byte rate is the clock
+ * rate. With calibrate_apply set, take the crystal that would give the
+ * nominal clock and reprogram the PLL from it.
+ */
+static void cxadc_cal_work(struct work_struct *work)
+{
+	struct cxadc *ctd = container_of(work, struct cxadc, cal_work);
+	u64 bytes = (ctd->cal_end_page - ctd->cal_start_page) << PAGE_SHIFT;
+	u64 time_ns = ctd->cal_end_ns - ctd->cal_start_ns;
+	u64 nominal, rate, rem;
+
+	mutex_lock(&ctd->lock);
+	nominal = cxadc_nominal_rate(ctd);
+	/* fits in 64 bits for MAX_CALIBRATE_MS at any clock the card can do */
+	rate = div64_u64_rem(bytes * NSEC_PER_SEC, time_ns, &rem);
+	ctd->cal_rate_millihz = rate * 1000 + div64_u64(rem * 1000, time_ns);
+	ctd->cal_ppb = div64_s64(((s64)ctd->cal_rate_millihz - (s64)nominal * 1000) * 1000000, nominal);
+	ctd->cal_crystal = div64_u64((u64)ctd->crystal * ctd->cal_rate_millihz, nominal * 1000);
+
+	cx_info("calibration: clock %llu Hz, %lld ppb from %llu Hz, crystal %llu Hz\n",
+		rate, ctd->cal_ppb, nominal, ctd->cal_crystal);
+
+	/* much further out than a crystal's tolerance is a setting, not drift */
+	if (ctd->calibrate_apply && abs(ctd->cal_ppb) > 1000 * 1000) {
+		cx_err("calibration: not applying an error over 1000 ppm, check tenxfsc and crystal\n");
+	} else if (ctd->calibrate_apply) {
+		ctd->crystal = ctd->cal_crystal;
+		cxadc_apply_clock(ctd);
+	}
+	mutex_unlock(&ctd->lock);
+}
+
+/*
+ * Program the card from scratch with the DMA stopped. Used by probe and
+ * resume, where the register shadow can't be trusted.
+ */
+static void cxadc_init_hw(struct cxadc *ctd)
+{
+	u32 intstat;
+
+	ctd->regs_valid = 0;
+
+	pci_set_master(ctd->pci);
+	disable_card(ctd);
+
+	/* we use 16kbytes of FIFO buffer */
+	create_cdt_table(ctd, NUMBER_OF_CLUSTER_BUFFER, CLUSTER_BUFFER_SIZE,
+		CLUSTER_BUFFER_BASE, CDT_BASE);
+
+	/* size of one buffer in qword -1 */
+	cx_write(MO_DMA24_CNT1, (CLUSTER_BUFFER_SIZE/8-1));
+
+	/* ptr to cdt */
+	cx_write(MO_DMA24_PTR2, CDT_BASE);
+	/* size of cdt in qword */
+	cx_write(MO_DMA24_CNT2, 2*NUMBER_OF_CLUSTER_BUFFER);
+
+	/* clear interrupt */
+	intstat = cx_read(MO_VID_INTSTAT);
+	cx_write(MO_VID_INTSTAT, intstat);
+
+	cxadc_apply_vmux(ctd);
+	cx_write(MO_OUTPUT_FORMAT, 0x0f); /* allow full range */
+
+	cx_write(MO_CONTR_BRIGHT, 0xff00);
+
+	/* vbi lenght CLUSTER_BUFFER_SIZE/2  work */
+
+	/*
+	 * no of byte transferred from peripehral to fifo
+	 * if fifo buffer < this, it will still transfer this no of byte
+	 * must be multiple of 8, if not go haywire?
+	 */
+	cx_write(MO_VBI_PACKET, (((CLUSTER_BUFFER_SIZE)<<17)|(2<<11)));
+
+	/* raw mode & byte swap <<8 (3<<8=swap) */
+	cx_write(MO_COLOR_CTRL, ((0xe)|(0xe<<4)|(0<<8)));
+
+	cxadc_apply_tenbit(ctd);
+
+	/* power down audio and chroma DAC+ADC */
+	cx_write(MO_AFECFG_IO, 0x12);
+
+	cxadc_apply_clock(ctd);
+
+	/* set vbi agc */
+	cx_write(MO_AGC_SYNC_SLICER, 0x0);
+
+	cx_write(MO_AGC_BACK_VBI, (0<<27)|(0<<26)|(1<<25)|(0x100<<16)|(0xfff<<0));
+	/* for 'cooked' composite */
+	cx_write(MO_AGC_SYNC_TIP1, (0x1c0<<17)|(0x0<<9)|(0<<7)|(0xf<<0));
+	cx_write(MO_AGC_SYNC_TIP2, (0x20<<17)|(0x0<<9)|(0<<7)|(0xf<<0));
+	cx_write(MO_AGC_GAIN_ADJ1, (0xe0<<17)|(0xe<<9)|(0x0<<7)|(0x7<<0));
+	cx_write(MO_AGC_GAIN_ADJ2, (0x20<<17)|(2<<7)|0x0f);
+	/* set gain of agc but not offset */
+	cx_write(MO_AGC_GAIN_ADJ3, (0x28<<16)|(0x28<<8)|(0x50<<0));
+	cxadc_write_gain(ctd);
+
+	cxadc_apply_audsel(ctd);
+
+	/* i2c sda/scl set to high and use software control */
+	cx_write(MO_I2C, 3);
+}
+
+static void cxadc_poll_head(struct cxadc *ctd);
+
+/*
+ * Bring the card up for the first user: apply any new ring settings, program
+ * the capture settings, start the DMA and put the head where the card is.
+ * Doesn't wait for an IRQ: if the card has only just started, the head stays
+ * at the start of the capture and the first IRQ (or poll) moves it on.
+ * Called with ctd->lock held.
+ */
+static int cxadc_start_capture(struct cxadc *ctd)
+{
+	int rv;
+
+	/* a stop that is already running waits for the lock, then sees users */
+	cancel_delayed_work(&ctd->stop_work);
+
+	rv = cxadc_update_ring(ctd);
+	if (rv)
+		return rv;
+
+	/* a ring still filling with the other sample size is restarted, not handed out */
+	if (ctd->dma_running && cxadc_hw_tenbit(ctd) != !!ctd->tenbit) {
+		cxadc_stop_dma(ctd);
+		ctd->dma_running = false;
+	}
+
+	/*
+	 * Program the capture before the DMA starts, so the first pages readers
+	 * get were captured with it. tenbit only takes effect here. The other
+	 * settings were applied when they were set, so these only write what
+	 * the card has lost.
+	 */
+	cxadc_apply_vmux(ctd);
+	cxadc_apply_tenbit(ctd);
+	cxadc_apply_clock(ctd);
+	cxadc_write_gain(ctd);
+
+	cxadc_dma_on(ctd);
 
 	atomic_set(&ctd->lgpcnt, -1);
+	WRITE_ONCE(ctd->status->lgpcnt, -1);
+	cxadc_poll_head(ctd);
+	/*
+	 * Registers are already current, this logs the starting gain. It goes
+	 * after the resync, so the event is at the head and not at a page
+	 * worked out from the last capture's count.
+	 */
+	cxadc_set_gain(ctd);
 	cx_write(MO_PCI_INTMSK, 1); /* enable interrupt */
 
-	rv = wait_event_interruptible(ctd->readQ, atomic_read(&ctd->lgpcnt) != -1);
-	if (rv) {
-		cx_write(MO_PCI_INTMSK, 0);
+	/* zero while this open isn't polling, so resume knows not to start it */
+	ctd->poll_period = ns_to_ktime((u64)ctd->poll_us * NSEC_PER_USEC);
+	if (ctd->poll_period)
+		hrtimer_start(&ctd->poll_timer, ctd->poll_period, HRTIMER_MODE_REL);
 
-		mutex_lock(&ctd->lock);
-		ctd->in_use = false;
-		mutex_unlock(&ctd->lock);
+	return 0;
+}
 
-		return rv;
+/* the last user has gone: stop the poll timer and schedule the DMA to stop */
+static void cxadc_stop_capture(struct cxadc *ctd)
+{
+	hrtimer_cancel(&ctd->poll_timer);
+	/*
+	 * The IRQ stays on until cxadc_stop_work() stops the DMA, so hw_pages
+	 * keeps counting laps for a warm reopen. It stops queueing the levels
+	 * work once there are no users, but one already running may not have
+	 * seen that yet.
+	 */
+	synchronize_irq(ctd->irq);
+	cancel_work_sync(&ctd->levels_work);
+	cxadc_cal_restart(ctd);
+	if (ctd->dma_idle_ms >= 0)
+		schedule_delayed_work(&ctd->stop_work, msecs_to_jiffies(ctd->dma_idle_ms));
+}
+
+/* set up a reader to convert the ring to format as it reads it */
+static int cxadc_reader_set_format(struct cxadc_reader *reader, int format)
+{
+	struct cxadc *ctd = reader->ctd;
+
+	/* the running capture decides the sample size, not a pending tenbit */
+	reader->format = format;
+	reader->sample_size = cxadc_hw_tenbit(ctd) ? 2 : 1;
+	reader->in_unit = reader->sample_size;
+	reader->out_unit = reader->in_unit;
+
+	switch (format) {
+	case CXADC_FORMAT_RAW:
+		return 0;
+	case CXADC_FORMAT_SIGNED:
+		break;
+	case CXADC_FORMAT_RJ16:
+	case CXADC_FORMAT_PACKED10:
+		if (!cxadc_hw_tenbit(ctd)) {
+			cx_err("format %s needs tenbit\n", cxadc_format_names[format]);
+			return -EINVAL;
+		}
+		if (format == CXADC_FORMAT_PACKED10) {
+			reader->in_unit = 8;
+			reader->out_unit = 5;
+		}
+		break;
 	}
 
-	ctd->initial_page = atomic_read(&ctd->lgpcnt);
+	/* output is never bigger than input, so a page is enough */
+	reader->bounce = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!reader->bounce)
+		return -ENOMEM;
+	return 0;
+}
+
+/*
+ * Convert up to len bytes of the ring at src, in whole sample groups and no
+ * more than it takes to make count bytes of output, into reader->bounce.
+ * Returns the number of ring bytes used.
+ */
+static unsigned int cxadc_convert(struct cxadc_reader *reader, const void *src,
+		unsigned int len, size_t count)
+{
+	unsigned int groups = min_t(size_t, len / reader->in_unit,
+				    DIV_ROUND_UP(count, reader->out_unit));
+	const __le16 *s16 = src;
+	const u8 *s8 = src;
+	__le16 *d16 = (__le16 *)reader->bounce;
+	u8 *d8 = reader->bounce;
+	unsigned int i;
+	u16 a, b, c, d;
+
+	switch (reader->format) {
+	case CXADC_FORMAT_SIGNED:
+		if (reader->in_unit == 1) {
+			for (i = 0; i < groups; i++)
+				d8[i] = s8[i] ^ 0x80;
+		} else {
+			for (i = 0; i < groups; i++)
+				d16[i] = s16[i] ^ cpu_to_le16(0x8000);
+		}
+		break;
+	case CXADC_FORMAT_RJ16:
+		for (i = 0; i < groups; i++)
+			d16[i] = cpu_to_le16(le16_to_cpu(s16[i]) >> 6);
+		break;
+	case CXADC_FORMAT_PACKED10:
+		for (i = 0; i < groups; i++, s16 += 4, d8 += 5) {
+			a = le16_to_cpu(s16[0]) >> 6;
+			b = le16_to_cpu(s16[1]) >> 6;
+			c = le16_to_cpu(s16[2]) >> 6;
+			d = le16_to_cpu(s16[3]) >> 6;
+			d8[0] = a;
+			d8[1] = (a >> 8) | (b << 2);
+			d8[2] = (b >> 6) | (c << 4);
+			d8[3] = (c >> 4) | (d << 6);
+			d8[4] = d >> 2;
+		}
+		break;
+	}
+
+	reader->bounce_len = groups * reader->out_unit;
+	return groups * reader->in_unit;
+}
+
+static int cxadc_char_open(struct inode *inode, struct file *file)
+{
+	int minor = iminor(inode);
+	struct cxadc *ctd = container_of(inode->i_cdev, struct cxadc, cdev);
+	struct cxadc_reader *reader;
+	int rv = 0;
+
+	for (ctd = cxadcs; ctd != NULL; ctd = ctd->next)
+		if (MINOR(ctd->cdev.dev) == minor)
+			break;
+	if (ctd == NULL)
+		return -ENODEV;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+	reader->ctd = ctd;
+	mutex_init(&reader->lock);
+
+	mutex_lock(&ctd->lock);
+	if (ctd->users == 0) {
+		rv = cxadc_start_capture(ctd);
+		if (rv)
+			goto fail;
+	}
+
+	rv = cxadc_reader_set_format(reader, ctd->format);
+	if (rv)
+		goto fail;
+	ctd->users++;
+
+	/* each reader starts at the newest data and has its own cursor */
+	reader->pos = (u64)atomic64_read(&ctd->hw_pages) << PAGE_SHIFT;
+	list_add_tail(&reader->node, &ctd->readers);
+	mutex_unlock(&ctd->lock);
+
+	kref_get(&ctd->refcnt);
+	file->private_data = reader;
+	/* reads honour IOCB_NOWAIT, so RWF_NOWAIT and io_uring need not punt */
+	file->f_mode |= FMODE_NOWAIT;
+	trace_cxadc_open(minor);
 
 	return 0;
+
+fail:
+	if (ctd->users == 0)
+		cxadc_stop_capture(ctd);
+	mutex_unlock(&ctd->lock);
+	kfree(reader->bounce);
+	kfree(reader);
+	return rv;
 }
 
 static int cxadc_char_release(struct inode *inode, struct file *file)
 {
-	struct cxadc *ctd = file->private_data;
+	struct cxadc_reader *reader = file->private_data;
+	struct cxadc *ctd = reader->ctd;
 
-	cx_write(MO_PCI_INTMSK, 0);
+	trace_cxadc_release(MINOR(ctd->cdev.dev));
 
 	mutex_lock(&ctd->lock);
-	ctd->in_use = false;
+	list_del(&reader->node);
+	if (--ctd->users == 0)
+		cxadc_stop_capture(ctd);
 	mutex_unlock(&ctd->lock);
+
+	kfree(reader->bounce);
+	kfree(reader);
 	return 0;
 }
 
-static ssize_t cxadc_char_read(struct file *file, char __user *tgt,
-		size_t count, loff_t *offset)
+/* has the card overwritten data this reader has not read yet? */
+static bool cxadc_reader_lagged(struct cxadc_reader *reader, u64 head)
 {
-	struct cxadc *ctd = file->private_data;
-	unsigned int rv = 0;
+	/*
+	 * The card may be up to one IRQ period past the last page we have been
+	 * told about, so a reader further behind than this may have been lapped.
+	 */
+	return head - (reader->pos >> PAGE_SHIFT) >
+		reader->ctd->ring_pages - reader->ctd->irq_period_pages;
+}
+
+/* does the DMA page holding absolute page number page still contain it? */
+static bool cxadc_page_current(struct cxadc *ctd, u64 page)
+{
+	u32 index;
+	u64 lap = div_u64_rem(page, ctd->ring_pages, &index);
+
+	/* pairs with smp_wmb() in cxadc_irq() */
+	smp_rmb();
+	return READ_ONCE(ctd->page_gen[index]) == (u32)lap + 1;
+}
+
+/* raise a high-water mark statistic to val */
+static void cxadc_stat_max(atomic64_t *stat, u64 val)
+{
+	s64 old = atomic64_read(stat);
+
+	while ((u64)old < val) {
+		s64 prev = atomic64_cmpxchg(stat, old, val);
+
+		if (prev == old)
+			break;
+		old = prev;
+	}
+}
+
+/* skip a lapped reader forward to the newest data and account for the gap */
+static void cxadc_reader_resync(struct cxadc_reader *reader, u64 head)
+{
+	struct cxadc *ctd = reader->ctd;
+	u64 dropped = (head << PAGE_SHIFT) - reader->pos;
+
+	reader->overruns++;
+	reader->dropped_bytes += dropped;
+	atomic64_inc(&ctd->overruns);
+	atomic64_add(dropped, &ctd->dropped_bytes);
+
+	cx_warn_ratelimited("reader overrun, dropped %llu bytes\n",
+			    (unsigned long long)dropped);
+
+	reader->pos = head << PAGE_SHIFT;
+}
+
+/*
+ * Move a reader to bytes before the head, or less if the ring doesn't hold
+ * that much of the current capture. Returns how far back it went.
+ */
+static u64 cxadc_reader_rewind(struct cxadc_reader *reader, u64 bytes)
+{
+	struct cxadc *ctd = reader->ctd;
+	u64 head = atomic64_read(&ctd->hw_pages);
+	u64 pages = (bytes >> PAGE_SHIFT) + !!(bytes & ~PAGE_MASK);
+	u64 n;
+
+	/* leave an IRQ period of grace before the card laps the reader */
+	pages = min_t(u64, pages, ctd->ring_pages - 2 * ctd->irq_period_pages);
+	pages = min(pages, head);
+	for (n = 0; n < pages; n++)
+		if (!cxadc_page_current(ctd, head - n - 1))
+			break;
+
+	reader->pos = (head - n) << PAGE_SHIFT;
+	reader->pending_len = 0;
+	return n << PAGE_SHIFT;
+}
+
+static ssize_t cxadc_reader_read(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *file = iocb->ki_filp;
+	struct cxadc_reader *reader = file->private_data;
+	struct cxadc *ctd = reader->ctd;
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	size_t count = iov_iter_count(to);
+	size_t copied, want;
+	ssize_t rv = 0;
 	unsigned int pnum;
-	int gp_cnt;
+	u64 head;
+
+again:
+	/* finish off the sample group the last read split */
+	if (reader->pending_len && count) {
+		copied = copy_to_iter(reader->pending, min_t(size_t, reader->pending_len, count), to);
+		if (!copied)
+			return -EFAULT;
+		reader->pending_len -= copied;
+		memmove(reader->pending, reader->pending + copied, reader->pending_len);
+		iocb->ki_pos += copied;
+		atomic64_add(copied, &ctd->bytes_read);
+		return copied;
+	}
 
-	pnum = (*offset % VBI_DMA_BUFF_SIZE) / PAGE_SIZE;
-	pnum += ctd->initial_page;
-	pnum %= MAX_DMA_PAGE;
+	head = atomic64_read(&ctd->hw_pages);
+	cxadc_stat_max(&ctd->max_lag_pages, head - (reader->pos >> PAGE_SHIFT));
 
-	gp_cnt = atomic_read(&ctd->lgpcnt);
+	/* a read never spans a gap, so report it at the start of the next one */
+	if (cxadc_reader_lagged(reader, head))
+		cxadc_reader_resync(reader, head);
 
-	if ((pnum == gp_cnt) && (file->f_flags & O_NONBLOCK))
-		return rv;
+	/* nothing to read yet is not end of file, even straight after a resync */
+	if ((reader->pos >> PAGE_SHIFT) == head) {
+		if (nowait || (file->f_flags & O_NONBLOCK))
+			return -EAGAIN;
+	}
 
 	while (count) {
-		while ((count > 0) && (pnum != gp_cnt)) {
-			unsigned int len;
+		while ((count > 0) && ((reader->pos >> PAGE_SHIFT) != head)) {
+			unsigned int len, off;
+
+			pnum = cxadc_ring_index(ctd, reader->pos >> PAGE_SHIFT);
+			off = reader->pos % PAGE_SIZE;
 
 			/* handle partial pages for either reason */
-			len = (*offset % PAGE_SIZE) ? (PAGE_SIZE - (*offset % PAGE_SIZE)) : PAGE_SIZE;
-			if (len > count)
-				len = count;
-
-			if (copy_to_user(tgt, ctd->pgvec_virt[pnum] + (*offset % PAGE_SIZE), len))
-				return -EFAULT;
-			memset(ctd->pgvec_virt[pnum] + (*offset % PAGE_SIZE), 0, len);
-
-			count -= len;
-			tgt += len;
-			*offset += len;
-			rv += len;
-
-			pnum = (*offset % VBI_DMA_BUFF_SIZE) / PAGE_SIZE;
-			pnum += ctd->initial_page;
-			pnum %= MAX_DMA_PAGE;
-		}
-		/*
-		 * adding code to allow level change during read, have tested, works with CAV capture
-		 * script i have been working on
-		 */
-		if (ctd->level < 0)
-			ctd->level = 0;
-		if (ctd->level > 31)
-			ctd->level = 31;
-		cx_write(MO_AGC_GAIN_ADJ4, (ctd->sixdb<<23)|(0<<22)|(0<<21)|(ctd->level<<16)|(0xff<<8)|(0x0<<0));
-		cx_write(MO_AGC_SYNC_TIP3, (0x1e48<<16)|(0xff<<8)|(ctd->center_offset));
+			len = PAGE_SIZE - off;
+			if (reader->format == CXADC_FORMAT_RAW) {
+				if (len > count)
+					len = count;
+				copied = copy_to_iter(ctd->pgvec_virt[pnum] + off, len, to);
+			} else {
+				/* copied out below, once we know the data is good */
+				len = cxadc_convert(reader, ctd->pgvec_virt[pnum] + off, len, count);
+				copied = 0;
+			}
+
+			/*
+			 * If the page has been refilled since it was completed, or the card
+			 * lapped us while we were copying, the data may be torn or stale,
+			 * so don't hand it out.
+			 */
+			if (!cxadc_page_current(ctd, reader->pos >> PAGE_SHIFT) ||
+			    cxadc_reader_lagged(reader, atomic64_read(&ctd->hw_pages))) {
+				iov_iter_revert(to, copied);
+				if (rv)
+					return rv;
+				head = atomic64_read(&ctd->hw_pages);
+				cxadc_reader_resync(reader, head);
+				continue;
+			}
+
+			if (reader->format == CXADC_FORMAT_RAW) {
+				want = len;
+			} else {
+				/* keep output that doesn't fit for the next read */
+				want = min_t(size_t, reader->bounce_len, count);
+				copied = copy_to_iter(reader->bounce, want, to);
+				reader->pending_len = reader->bounce_len - want;
+				memcpy(reader->pending, reader->bounce + want, reader->pending_len);
+			}
+
+			trace_cxadc_copy(MINOR(ctd->cdev.dev), reader->pos >> PAGE_SHIFT, copied);
+			count -= copied;
+			iocb->ki_pos += copied;
+			reader->pos += (reader->format == CXADC_FORMAT_RAW) ? copied : len;
+			rv += copied;
+			atomic64_add(copied, &ctd->bytes_read);
 
+			if (copied != want)
+				return rv ? rv : -EFAULT;
+		}
 		if (count) {
 			int rv2;
 
-			if (file->f_flags & O_NONBLOCK)
-				return rv;
+			if (nowait || (file->f_flags & O_NONBLOCK))
+				return rv ? rv : -EAGAIN;
 
-			rv2 = wait_event_interruptible(ctd->readQ, atomic_read(&ctd->lgpcnt) != gp_cnt);
+			/* don't hold up poll, other reads or a group start while asleep */
+			mutex_unlock(&reader->lock);
+			rv2 = wait_event_interruptible(ctd->readQ, atomic64_read(&ctd->hw_pages) != head);
+			mutex_lock(&reader->lock);
 			if (rv2) {
 				return rv ? rv : rv2;
 			}
+			atomic64_inc(&ctd->wakeups);
+
+			/* another read may have split a sample group meanwhile */
+			if (reader->pending_len) {
+				if (rv)
+					return rv;
+				goto again;
+			}
 
-			gp_cnt = atomic_read(&ctd->lgpcnt);
+			head = atomic64_read(&ctd->hw_pages);
+			trace_cxadc_wakeup(MINOR(ctd->cdev.dev), head, reader->pos);
 		}
 	};
 
 	return rv;
 }
 
+/* snapshot the IRQ timestamp log, see struct cxadc_timestamp */
+static void cxadc_copy_timestamps(struct cxadc *ctd, struct cxadc_timestamp_log *log)
+{
+	struct cxadc_timestamp *ts = ctd->status->timestamps;
+	unsigned int i;
+	u64 seq;
+
+	log->seq = READ_ONCE(ctd->status->timestamp_seq);
+	for (i = 0; i < CXADC_TIMESTAMP_LOG_SIZE; i++) {
+		seq = READ_ONCE(ts[i].seq);
+		smp_rmb();
+		log->entries[i].page = READ_ONCE(ts[i].page);
+		log->entries[i].time_ns = READ_ONCE(ts[i].time_ns);
+		smp_rmb();
+		log->entries[i].seq = (READ_ONCE(ts[i].seq) == seq) ? seq : 0;
+	}
+}
+
+static ssize_t cxadc_char_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct cxadc_reader *reader = iocb->ki_filp->private_data;
+	ssize_t rv;
+
+	/* io_uring workers and threads sharing the fd may read at once */
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!mutex_trylock(&reader->lock))
+			return -EAGAIN;
+	} else if (mutex_lock_interruptible(&reader->lock)) {
+		return -ERESTARTSYS;
+	}
+	rv = cxadc_reader_read(iocb, to);
+	mutex_unlock(&reader->lock);
+
+	return rv;
+}
+
+static __poll_t cxadc_char_poll(struct file *file, poll_table *wait)
+{
+	struct cxadc_reader *reader = file->private_data;
+	struct cxadc *ctd = reader->ctd;
+	u64 head;
+
+	poll_wait(file, &ctd->readQ, wait);
+
+	/*
+	 * Readable once a page past the reader has completed. A lapped reader
+	 * would be moved to the head by the read and get nothing, so move it
+	 * here and wait for the next page instead.
+	 */
+	head = atomic64_read(&ctd->hw_pages);
+	if (cxadc_reader_lagged(reader, head) && mutex_trylock(&reader->lock)) {
+		/* a read in flight resyncs it anyway */
+		if (cxadc_reader_lagged(reader, head))
+			cxadc_reader_resync(reader, head);
+		mutex_unlock(&reader->lock);
+	}
+
+	if ((READ_ONCE(reader->pos) >> PAGE_SHIFT) != head || READ_ONCE(reader->pending_len))
+		return EPOLLIN | EPOLLRDNORM;
+
+	return 0;
+}
+
+static const struct file_operations cxadc_char_fops;
+
+/* CXADC_IOC_GROUP_START: restart several cards as close together as possible */
+static int cxadc_group_start(struct cxadc_group_start __user *uarg)
+{
+	struct cxadc_group_start gs;
+	struct file *files[CXADC_GROUP_MAX];
+	struct cxadc_reader *readers[CXADC_GROUP_MAX];
+	bool polled[CXADC_GROUP_MAX];
+	struct cxadc_reader *reader;
+	struct cxadc *ctd;
+	unsigned long flags;
+	unsigned int i, j, n;
+	int rc = 0;
+
+	if (copy_from_user(&gs, uarg, sizeof(gs)))
+		return -EFAULT;
+	if (gs.count == 0 || gs.count > CXADC_GROUP_MAX)
+		return -EINVAL;
+
+	for (n = 0; n < gs.count; n++) {
+		files[n] = fget(gs.fds[n]);
+		if (!files[n]) {
+			rc = -EBADF;
+			goto out;
+		}
+		if (files[n]->f_op != &cxadc_char_fops) {
+			n++;
+			rc = -EINVAL;
+			goto out;
+		}
+		readers[n] = files[n]->private_data;
+		for (j = 0; j < n; j++) {
+			if (readers[j]->ctd == readers[n]->ctd) {
+				n++;
+				rc = -EINVAL;
+				goto out;
+			}
+		}
+	}
+
+	mutex_lock(&cxadc_group_lock);
+
+	/*
+	 * Stop every card and rewind its ring, with its IRQ handler kept away.
+	 * Each card stays locked until it is running again, so open, release
+	 * and the settings never see it half restarted. cxadc_group_lock keeps
+	 * two group starts from taking the card locks in different orders.
+	 */
+	for (i = 0; i < n; i++) {
+		ctd = readers[i]->ctd;
+
+		mutex_lock_nest_lock(&ctd->lock, &cxadc_group_lock);
+		/* the poll timer would follow the stale count across the rewind */
+		polled[i] = hrtimer_cancel(&ctd->poll_timer);
+		cx_write(MO_VID_INTMSK, 0);
+		synchronize_irq(ctd->irq);
+		cxadc_stop_dma(ctd);
+		cx_write(MO_VID_INTSTAT, cx_read(MO_VID_INTSTAT));
+
+		/* cxadc_card_page() reads the head and count together */
+		spin_lock_irqsave(&ctd->advance_lock, flags);
+		gs.start_page[i] = cxadc_rewind(ctd);
+		spin_unlock_irqrestore(&ctd->advance_lock, flags);
+
+		/* every reader of the card starts again from the restart */
+		list_for_each_entry(reader, &ctd->readers, node) {
+			mutex_lock(&reader->lock);
+			reader->pos = gs.start_page[i] << PAGE_SHIFT;
+			reader->pending_len = 0;
+			mutex_unlock(&reader->lock);
+		}
+	}
+
+	/* then start them back to back */
+	local_irq_save(flags);
+	for (i = 0; i < n; i++) {
+		cxadc_start_dma(readers[i]->ctd);
+		gs.start_ns[i] = ktime_get_boottime_ns();
+		readers[i]->ctd->dma_running = true;
+	}
+	local_irq_restore(flags);
+
+	for (i = 0; i < n; i++) {
+		ctd = readers[i]->ctd;
+		cx_write(MO_VID_INTMSK, INTERRUPT_MASK);
+		if (polled[i])
+			hrtimer_start(&ctd->poll_timer, ctd->poll_period, HRTIMER_MODE_REL);
+		mutex_unlock(&ctd->lock);
+	}
+
+	mutex_unlock(&cxadc_group_lock);
+
+	if (copy_to_user(uarg, &gs, sizeof(gs)))
+		rc = -EFAULT;
+
+out:
+	while (n--)
+		fput(files[n]);
+	return rc;
+}
+
 static long cxadc_char_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
-	struct cxadc *ctd = file->private_data;
+	struct cxadc_reader *reader = file->private_data;
+	struct cxadc *ctd = reader->ctd;
 	int ret = 0;
 
-	if (cmd == 0x12345670) {
+	switch (cmd) {
+	case 0x12345670: {
 		int gain = arg;
 
-		if (gain < 0)
-			gain = 0;
-		if (gain > 31)
-			gain = 31;
-
-		/* control gain also bit 16 */
-		cx_write(MO_AGC_GAIN_ADJ4, (ctd->sixdb<<23)|(0<<22)|(0<<21)|(gain<<16)|(0xff<<8)|(0x0<<0));
+		mutex_lock(&ctd->lock);
+		ctd->level = gain;
+		cxadc_set_gain(ctd);
+		mutex_unlock(&ctd->lock);
+		break;
+	}
+	case CXADC_IOC_GET_OVERRUNS: {
+		struct cxadc_overruns ov;
+
+		mutex_lock(&reader->lock);
+		ov.overruns = reader->overruns;
+		ov.dropped_bytes = reader->dropped_bytes;
+		mutex_unlock(&reader->lock);
+		if (copy_to_user((void __user *)arg, &ov, sizeof(ov)))
+			ret = -EFAULT;
+		break;
+	}
+	case CXADC_IOC_GET_TIMESTAMPS: {
+		struct cxadc_timestamp_log *log = kmalloc(sizeof(*log), GFP_KERNEL);
+
+		if (!log)
+			return -ENOMEM;
+		cxadc_copy_timestamps(ctd, log);
+		if (copy_to_user((void __user *)arg, log, sizeof(*log)))
+			ret = -EFAULT;
+		kfree(log);
+		break;
+	}
+	case CXADC_IOC_GET_EVENTS: {
+		struct cxadc_event_log *log = kmalloc(sizeof(*log), GFP_KERNEL);
+
+		if (!log)
+			return -ENOMEM;
+		spin_lock_irq(&ctd->event_lock);
+		*log = ctd->events;
+		spin_unlock_irq(&ctd->event_lock);
+		if (copy_to_user((void __user *)arg, log, sizeof(*log)))
+			ret = -EFAULT;
+		kfree(log);
+		break;
+	}
+	case CXADC_IOC_GROUP_START:
+		ret = cxadc_group_start((struct cxadc_group_start __user *)arg);
+		break;
+	case CXADC_IOC_GET_POSITION: {
+		struct cxadc_position p = {
+			.head_bytes = (u64)atomic64_read(&ctd->hw_pages) << PAGE_SHIFT,
+			.sample_size = reader->sample_size,
+		};
+
+		mutex_lock(&reader->lock);
+		p.read_bytes = reader->pos;
+		mutex_unlock(&reader->lock);
+		p.head_samples = div_u64(p.head_bytes, p.sample_size);
+		p.read_samples = div_u64(p.read_bytes, p.sample_size);
+		if (copy_to_user((void __user *)arg, &p, sizeof(p)))
+			ret = -EFAULT;
+		break;
+	}
+	case CXADC_IOC_GET_LEVELS: {
+		struct cxadc_levels lv;
+
+		spin_lock(&ctd->levels_lock);
+		lv = ctd->levels;
+		spin_unlock(&ctd->levels_lock);
+		lv.skipped = atomic64_read(&ctd->levels_skipped);
+		if (copy_to_user((void __user *)arg, &lv, sizeof(lv)))
+			ret = -EFAULT;
+		break;
+	}
+	case CXADC_IOC_REWIND: {
+		u64 __user *uarg = (u64 __user *)arg;
+		u64 bytes;
+
+		if (get_user(bytes, uarg))
+			return -EFAULT;
+		if (mutex_lock_interruptible(&reader->lock))
+			return -ERESTARTSYS;
+		bytes = cxadc_reader_rewind(reader, bytes);
+		mutex_unlock(&reader->lock);
+		if (put_user(bytes, uarg))
+			ret = -EFAULT;
+		break;
+	}
 	}
 
 	return ret;
 }
 
+/*
+ * Map pages [first, first + count) of one coherent DMA allocation at addr
+ * within vma. dma_mmap_coherent() can only map from the start of the vma,
+ * so ask the DMA layer for the allocation's pages and map those directly.
+ */
+static int cxadc_mmap_coherent(struct cxadc *ctd, struct vm_area_struct *vma,
+		unsigned long addr, void *virt, dma_addr_t phy, size_t size,
+		unsigned long first, unsigned long count)
+{
+	struct sg_table sgt;
+	struct scatterlist *sg;
+	unsigned long n;
+	int i, rc;
+
+	rc = dma_get_sgtable(&ctd->pci->dev, &sgt, virt, phy, size);
+	if (rc)
+		return rc;
+
+	/* one entry if the allocation is physically contiguous, else one per run */
+	for_each_sg(sgt.sgl, sg, sgt.orig_nents, i) {
+		n = sg->length >> PAGE_SHIFT;
+		if (first >= n) {
+			first -= n;
+			continue;
+		}
+		n = min(n - first, count);
+		rc = remap_pfn_range(vma, addr, page_to_pfn(sg_page(sg)) + first,
+				     n << PAGE_SHIFT, vma->vm_page_prot);
+		if (rc)
+			break;
+		addr += n << PAGE_SHIFT;
+		count -= n;
+		first = 0;
+		if (!count)
+			break;
+	}
+
+	sg_free_table(&sgt);
+	return rc;
+}
+
+static void cxadc_vm_open(struct vm_area_struct *vma)
+{
+	struct cxadc *ctd = vma->vm_private_data;
+
+	atomic_inc(&ctd->mmap_count);
+}
+
+static void cxadc_vm_close(struct vm_area_struct *vma)
+{
+	struct cxadc *ctd = vma->vm_private_data;
+
+	atomic_dec(&ctd->mmap_count);
+}
+
+static const struct vm_operations_struct cxadc_vm_ops = {
+	.open  = cxadc_vm_open,
+	.close = cxadc_vm_close,
+};
+
+static int cxadc_char_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct cxadc_reader *reader = file->private_data;
+	struct cxadc *ctd = reader->ctd;
+	unsigned long pgoff = vma->vm_pgoff;
+	unsigned long addr, first, count;
+	struct cxadc_dma_chunk *chunk = ctd->chunks;
+	int rc;
+
+	/* the ring is written by the card, never by userspace */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	if (pgoff > CXADC_MMAP_STATUS_PAGES + ctd->ring_pages ||
+	    vma_pages(vma) > CXADC_MMAP_STATUS_PAGES + ctd->ring_pages - pgoff)
+		return -EINVAL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+
+	if (!CXADC_MMAP_RING) {
+		/* the status page alone is one allocation the DMA layer can map */
+		if (pgoff != 0 || vma_pages(vma) != CXADC_MMAP_STATUS_PAGES)
+			return -ENODEV;
+		rc = dma_mmap_coherent(&ctd->pci->dev, vma, ctd->status,
+				       ctd->status_phy, PAGE_SIZE);
+		if (rc)
+			return rc;
+		goto mapped;
+	}
+
+	for (addr = vma->vm_start; addr < vma->vm_end; addr += count << PAGE_SHIFT, pgoff += count) {
+		if (pgoff < CXADC_MMAP_STATUS_PAGES) {
+			count = 1;
+			rc = cxadc_mmap_coherent(ctd, vma, addr, ctd->status,
+						 ctd->status_phy, PAGE_SIZE, 0, count);
+		} else {
+			/* map as much of the chunk holding this page as we can in one go */
+			while (pgoff - CXADC_MMAP_STATUS_PAGES >=
+			       chunk->first_page + (chunk->size >> PAGE_SHIFT))
+				chunk++;
+			first = pgoff - CXADC_MMAP_STATUS_PAGES - chunk->first_page;
+			count = min((chunk->size >> PAGE_SHIFT) - first,
+				    (vma->vm_end - addr) >> PAGE_SHIFT);
+			rc = cxadc_mmap_coherent(ctd, vma, addr, chunk->virt, chunk->phy,
+						 chunk->size, first, count);
+		}
+		if (rc)
+			return rc;
+	}
+
+mapped:
+	vma->vm_ops = &cxadc_vm_ops;
+	vma->vm_private_data = ctd;
+	atomic_inc(&ctd->mmap_count);
+
+	return 0;
+}
+
 static const struct file_operations cxadc_char_fops = {
 	.owner    = THIS_MODULE,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 0)
 	.llseek   = no_llseek,
 #endif
 	.unlocked_ioctl = cxadc_char_ioctl,
+	/* the ioctl structs have the same layout for 32-bit callers */
+	.compat_ioctl = compat_ptr_ioctl,
 	.open     = cxadc_char_open,
 	.release  = cxadc_char_release,
-	.read     = cxadc_char_read,
+	.read_iter = cxadc_char_read_iter,
+	/* splice copies out of the ring through read_iter, as the card keeps overwriting it */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	.splice_read = copy_splice_read,
+#else
+	.splice_read = generic_file_splice_read,
+#endif
+	.poll     = cxadc_char_poll,
+	.mmap     = cxadc_char_mmap,
 };
 
+/* append to the IRQ timestamp log in the status page, called from the IRQ handler only */
+static void cxadc_log_timestamp(struct cxadc *ctd, u64 page, u64 time_ns)
+{
+	u64 seq = ctd->status->timestamp_seq + 1;
+	struct cxadc_timestamp *ts =
+		&ctd->status->timestamps[(seq - 1) & (CXADC_TIMESTAMP_LOG_SIZE - 1)];
+
+	WRITE_ONCE(ts->seq, 0);
+	smp_wmb();
+	WRITE_ONCE(ts->page, page);
+	WRITE_ONCE(ts->time_ns, time_ns);
+	smp_wmb();
+	WRITE_ONCE(ts->seq, seq);
+	WRITE_ONCE(ctd->status->timestamp_seq, seq);
+}
+
+/*
+ * Move the head on to ring index gp_cnt and wake up the readers. Called from
+ * the IRQ handler and the poll timer. Each can be a little behind the other
+ * (the IRQ rounds down to a period, the timer stays POLL_MARGIN_PAGES back),
+ * so an index just behind the head is ignored rather than taken as nearly a
+ * full lap. After a (re)start the first index only has to be in the lap the
+ * card is on, except that a poll that may have wrapped below 0 waits for the
+ * card to get further. Returns the new head.
+ */
+static u64 cxadc_advance(struct cxadc *ctd, int gp_cnt, bool poll)
+{
+	unsigned long flags;
+	int last_cnt;
+	u64 hw_pages, page;
+	u32 index, lap, delta;
+
+	spin_lock_irqsave(&ctd->advance_lock, flags);
+
+	last_cnt = atomic_read(&ctd->lgpcnt);
+	hw_pages = atomic64_read(&ctd->hw_pages);
+
+	if (last_cnt == -1) {
+		if (poll && gp_cnt >= ctd->ring_pages - POLL_MARGIN_PAGES)
+			goto out;
+		/* keep hw_pages counting up across opens, in step with gp_cnt */
+		last_cnt = cxadc_ring_index(ctd, hw_pages);
+		delta = (gp_cnt - last_cnt + ctd->ring_pages) % ctd->ring_pages;
+	} else {
+		delta = (gp_cnt - last_cnt + ctd->ring_pages) % ctd->ring_pages;
+		if (delta > ctd->ring_pages - ctd->irq_period_pages - POLL_MARGIN_PAGES)
+			goto out;
+		if (poll && delta == 0)
+			goto out;
+	}
+
+	/* record which lap each newly completed page belongs to */
+	page = hw_pages;
+	hw_pages += delta;
+	lap = div_u64_rem(page, ctd->ring_pages, &index);
+	for (; page < hw_pages; page++) {
+		WRITE_ONCE(ctd->page_gen[index], lap + 1);
+		if (++index == ctd->ring_pages) {
+			index = 0;
+			lap++;
+		}
+	}
+
+	/* publish the page generations before the new head */
+	smp_wmb();
+	atomic64_set(&ctd->hw_pages, hw_pages);
+	atomic_set(&ctd->lgpcnt, gp_cnt);
+	WRITE_ONCE(ctd->status->hw_pages, hw_pages);
+	WRITE_ONCE(ctd->status->lgpcnt, gp_cnt);
+	wake_up_interruptible(&ctd->readQ);
+out:
+	spin_unlock_irqrestore(&ctd->advance_lock, flags);
+	return hw_pages;
+}
+
+static inline void cxadc_levels_add(struct cxadc_levels *lv, u32 v, u32 full, unsigned int shift)
+{
+	lv->sum += v;
+	if (v < lv->min)
+		lv->min = v;
+	if (v > lv->max)
+		lv->max = v;
+	if (v == 0)
+		lv->clip_low++;
+	if (v == full)
+		lv->clip_high++;
+	lv->hist[v >> shift]++;
+}
+
+/*
+ * Measure the newest irq_period_pages pages for CXADC_IOC_GET_LEVELS. Queued
+ * by the IRQ while level_stats is set, so it runs once per block unless it
+ * falls a whole period behind.
+ */
+static void cxadc_levels_work(struct work_struct *work)
+{
+	struct cxadc *ctd = container_of(work, struct cxadc, levels_work);
+	bool tenbit = cxadc_hw_tenbit(ctd);
+	unsigned int bits = tenbit ? 10 : 8;
+	u32 full = (1 << bits) - 1;
+	unsigned int shift = bits - ilog2(CXADC_LEVELS_BINS);
+	u64 head = atomic64_read(&ctd->hw_pages);
+	struct cxadc_levels lv = {
+		.page = head - ctd->irq_period_pages,
+		.bits = bits,
+		.min = full,
+	};
+	unsigned int i;
+	u64 page;
+	u32 index;
+
+	if (head < ctd->irq_period_pages)
+		return;
+
+	for (page = lv.page; page < head; page++) {
+		div_u64_rem(page, ctd->ring_pages, &index);
+		if (tenbit) {
+			const __le16 *p = ctd->pgvec_virt[index];
+
+			for (i = 0; i < PAGE_SIZE / 2; i++)
+				cxadc_levels_add(&lv, le16_to_cpu(p[i]) >> 6, full, shift);
+		} else {
+			const u8 *p = ctd->pgvec_virt[index];
+
+			for (i = 0; i < PAGE_SIZE; i++)
+				cxadc_levels_add(&lv, p[i], full, shift);
+		}
+	}
+	lv.samples = (ctd->irq_period_pages << PAGE_SHIFT) / (tenbit ? 2 : 1);
+
+	/* the card fills pages in order, so if the oldest survived they all did */
+	if (!cxadc_page_current(ctd, lv.page))
+		return;
+
+	spin_lock(&ctd->levels_lock);
+	lv.seq = ctd->levels.seq + 1;
+	ctd->levels = lv;
+	spin_unlock(&ctd->levels_lock);
+}
+
+/* note the start and end of a calibration, see calibrate_ms */
+static void cxadc_calibrate(struct cxadc *ctd, u64 page, u64 time_ns)
+{
+	switch (READ_ONCE(ctd->cal_state)) {
+	case CXADC_CAL_ARMED:
+		ctd->cal_start_page = page;
+		ctd->cal_start_ns = time_ns;
+		WRITE_ONCE(ctd->cal_state, CXADC_CAL_RUNNING);
+		break;
+	case CXADC_CAL_RUNNING:
+		if (time_ns - ctd->cal_start_ns < (u64)ctd->calibrate_ms * NSEC_PER_MSEC)
+			break;
+		ctd->cal_end_page = page;
+		ctd->cal_end_ns = time_ns;
+		WRITE_ONCE(ctd->cal_state, CXADC_CAL_IDLE);
+		schedule_work(&ctd->cal_work);
+		break;
+	}
+}
+
+/* poll mode: follow MO_VBI_GPCNT between IRQs, see poll_us */
+/* move the head up to where the card is now, less what may be in the FIFO */
+static void cxadc_poll_head(struct cxadc *ctd)
+{
+	int gp_cnt = cx_read(MO_VBI_GPCNT);
+
+	/* only trust pages that must have left the FIFO */
+	gp_cnt = (gp_cnt - POLL_MARGIN_PAGES + ctd->ring_pages) % ctd->ring_pages;
+	cxadc_advance(ctd, gp_cnt, true);
+}
+
+static enum hrtimer_restart cxadc_poll_timer(struct hrtimer *timer)
+{
+	struct cxadc *ctd = container_of(timer, struct cxadc, poll_timer);
+
+	cxadc_poll_head(ctd);
+
+	hrtimer_forward_now(timer, ctd->poll_period);
+	return HRTIMER_RESTART;
+}
+
 static irqreturn_t cxadc_irq(int irq, void *dev_id)
 {
 	struct cxadc *ctd = dev_id;
@@ -834,22 +2977,40 @@ static irqreturn_t cxadc_irq(int irq, void *dev_id)
 	u32 astat = stat & allstat;
 	u32 ostat = astat;
 
-	if (ostat != 8 && allstat != 0 && ostat != 0)
-		cx_info("interrupt stat 0x%x masked 0x%x\n", allstat, ostat);
+	if (ostat != 8 && allstat != 0 && ostat != 0) {
+		atomic64_inc(&ctd->unexpected_irqs);
+		cx_info_ratelimited("interrupt stat 0x%x masked 0x%x\n", allstat, ostat);
+	}
 
-	if (!astat)
+	if (!astat) {
+		atomic64_inc(&ctd->irq_misses);
 		return IRQ_RETVAL(0); /* if no interrupt bit set we return */
+	}
+
+	atomic64_inc(&ctd->irqs);
 
 	if (astat & 0x8) {
+		u64 now = ktime_get_boottime_ns();
 		int gp_cnt = cx_read(MO_VBI_GPCNT);
+		u64 hw_pages, page;
+
 		/* NB: MO_VBI_GPCNT is not guaranteed to be in-sync with resident pages.
 		   i.e. we can get gpcnt == 1 but the first page may not yet have been transferred
 		   to main memory. on the other hand, if an interrupt has occurred, we are guaranteed to have the page
 		   in main memory. so we only retrieve MO_VBI_GPCNT after an interrupt has occurred and then round
 		   it down to the last page that we know should have triggered an interrupt. */
-		gp_cnt &= ~(IRQ_PERIOD_IN_PAGES - 1);
-		atomic_set(&ctd->lgpcnt, gp_cnt);
-		wake_up_interruptible(&ctd->readQ);
+		gp_cnt &= ~(ctd->irq_period_pages - 1);
+
+		hw_pages = cxadc_advance(ctd, gp_cnt, false);
+		/* the page this IRQ is for, the head may be further on in poll mode */
+		page = hw_pages - (cxadc_ring_index(ctd, hw_pages) - gp_cnt +
+				   ctd->ring_pages) % ctd->ring_pages;
+		cxadc_log_timestamp(ctd, page, now);
+		if (READ_ONCE(ctd->level_stats) && READ_ONCE(ctd->users) &&
+		    !queue_work(system_unbound_wq, &ctd->levels_work))
+			atomic64_inc(&ctd->levels_skipped);
+		cxadc_calibrate(ctd, page, now);
+		trace_cxadc_irq(MINOR(ctd->cdev.dev), astat, gp_cnt, hw_pages);
 	}
 	cx_write(MO_VID_INTSTAT, ostat);
 
@@ -859,13 +3020,9 @@ static irqreturn_t cxadc_irq(int irq, void *dev_id)
 static int cxadc_probe(struct pci_dev *pci_dev,
 			const struct pci_device_id *pci_id)
 {
-	u32 i, intstat;
 	struct cxadc *ctd;
 	unsigned char revision, lat;
 	int rc;
-	unsigned int total_size;
-	unsigned long longtenxfsc, longPLLboth, longPLLint;
-	int PLLint, PLLfrac, PLLfin, SConv;
 
 	if (pci_enable_device(pci_dev)) {
 		dev_err(&pci_dev->dev, "cxadc: enable device failed\n");
@@ -879,7 +3036,7 @@ static int cxadc_probe(struct pci_dev *pci_dev,
 		return -EBUSY;
 	}
 
-	ctd = kmalloc(sizeof(*ctd), GFP_KERNEL);
+	ctd = kmalloc_node(sizeof(*ctd), GFP_KERNEL, dev_to_node(&pci_dev->dev));
 	if (!ctd) {
 		rc = -ENOMEM;
 		dev_err(&pci_dev->dev, "cxadc: kmalloc failed\n");
@@ -906,9 +3063,25 @@ static int cxadc_probe(struct pci_dev *pci_dev,
 	ctd->crystal = default_crystal;
 	ctd->center_offset = default_center_offset;
 
+	ctd->ring_size_mb = ring_size_mb;
+	if (!ring_size_valid(ctd->ring_size_mb)) {
+		cx_err("invalid ring_size_mb %d, using %d\n",
+			ctd->ring_size_mb, default_ring_size_mb);
+		ctd->ring_size_mb = default_ring_size_mb;
+	}
+	ctd->irq_period_kb = default_irq_period_kb;
+	ctd->dma_idle_ms = default_dma_idle_ms;
+	ctd->poll_us = default_poll_us;
+	ctd->format = default_format;
+	ctd->level_stats = default_level_stats;
+	ctd->calibrate_ms = default_calibrate_ms;
+	ctd->calibrate_apply = default_calibrate_apply;
+	ctd->irq_period_pages = (ctd->irq_period_kb << 10) >> PAGE_SHIFT;
+
 	/*
 	 * creates our device attributs in
 	 * /sys/class/cxadc/cxadc[0-7]/device/parameters
+	 * and our counters in /sys/class/cxadc/cxadc[0-7]/device/stats
 	 */
 
 	if (sysfs_create_group(&pci_dev->dev.kobj, &mycxadc_group)) {
@@ -920,41 +3093,24 @@ static int cxadc_probe(struct pci_dev *pci_dev,
 
 	/* We can use cx_err/cx_info from here, now ctd has been set up. */
 
-	if (alloc_risc_inst_buffer(ctd)) {
-		cx_err("cannot alloc risc buffer\n");
+	if (sysfs_create_group(&pci_dev->dev.kobj, &mycxadc_stats_group)) {
+		cx_err("cannot create sysfs statistics\n");
 		rc = -ENOMEM;
 		goto fail1s;
 	}
 
-	for (i = 0; i < (MAX_DMA_PAGE+1); i++) {
-		ctd->pgvec_virt[i] = 0;
-		ctd->pgvec_phy[i] = 0;
+	if (alloc_status_page(ctd)) {
+		cx_err("cannot alloc status page\n");
+		rc = -ENOMEM;
+		goto fail1t;
 	}
 
-	total_size = 0;
-
-	for (i = 0; i < MAX_DMA_PAGE; i++) {
-		dma_addr_t dma_handle;
-
-		ctd->pgvec_virt[i] = dma_zalloc_coherent(&ctd->pci->dev, PAGE_SIZE,
-				&dma_handle, GFP_KERNEL);
-
-		if (ctd->pgvec_virt[i] != 0) {
-			ctd->pgvec_phy[i] = dma_handle;
-			total_size += PAGE_SIZE;
-		} else {
-			cx_err("alloc dma buffer failed. index = %u\n", i);
-
-			rc = -ENOMEM;
-			goto fail1x;
-		}
-
+	if (alloc_ring(ctd, ctd->ring_size_mb << (20 - PAGE_SHIFT))) {
+		cx_err("cannot alloc dma ring\n");
+		rc = -ENOMEM;
+		goto fail1x;
 	}
 
-	cx_info("total DMA size allocated = %u kb\n", total_size / 1024);
-
-	make_risc_instructions(ctd);
-
 	ctd->mem = pci_resource_start(pci_dev, 0);
 
 	ctd->mmio = ioremap(pci_resource_start(pci_dev, 0),
@@ -962,8 +3118,24 @@ static int cxadc_probe(struct pci_dev *pci_dev,
 
 	cx_info("MEM :%x MMIO :%p\n", ctd->mem, ctd->mmio);
 
-	ctd->in_use = false;
+	ctd->users = 0;
+	INIT_LIST_HEAD(&ctd->readers);
 	mutex_init(&ctd->lock);
+	ctd->dma_running = false;
+	INIT_DELAYED_WORK(&ctd->stop_work, cxadc_stop_work);
+	spin_lock_init(&ctd->advance_lock);
+	spin_lock_init(&ctd->event_lock);
+	INIT_WORK(&ctd->levels_work, cxadc_levels_work);
+	INIT_WORK(&ctd->cal_work, cxadc_cal_work);
+	spin_lock_init(&ctd->levels_lock);
+	/* nothing logged yet, so the first capture logs its starting gain */
+	ctd->hw_level = -1;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&ctd->poll_timer, cxadc_poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&ctd->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	ctd->poll_timer.function = cxadc_poll_timer;
+#endif
 	kref_init(&ctd->refcnt);
 
 	init_waitqueue_head(&ctd->readQ);
@@ -985,66 +3157,11 @@ static int cxadc_probe(struct pci_dev *pci_dev,
 	cx_info("irq: %d, latency: %d, mmio: 0x%x\n",
 		ctd->irq, lat, ctd->mem);
 
-	/* init hw */
-	pci_set_master(pci_dev);
-	disable_card(ctd);
-
-	/* we use 16kbytes of FIFO buffer */
-	create_cdt_table(ctd, NUMBER_OF_CLUSTER_BUFFER, CLUSTER_BUFFER_SIZE,
-		CLUSTER_BUFFER_BASE, CDT_BASE);
-
-	/* size of one buffer in qword -1 */
-	cx_write(MO_DMA24_CNT1, (CLUSTER_BUFFER_SIZE/8-1));
-
-	/* ptr to cdt */
-	cx_write(MO_DMA24_PTR2, CDT_BASE);
-	/* size of cdt in qword */
-	cx_write(MO_DMA24_CNT2, 2*NUMBER_OF_CLUSTER_BUFFER);
-
-	/* clear interrupt */
-	intstat = cx_read(MO_VID_INTSTAT);
-	cx_write(MO_VID_INTSTAT, intstat);
-
-	cx_write(CHN24_CMDS_BASE, ctd->risc_inst_phy); /* working */
-	cx_write(CHN24_CMDS_BASE+4, CDT_BASE);
-	cx_write(CHN24_CMDS_BASE+8, 2*NUMBER_OF_CLUSTER_BUFFER);
-	cx_write(CHN24_CMDS_BASE+12, RISC_INST_QUEUE);
-
-	cx_write(CHN24_CMDS_BASE+16, 0x40);
-
-	/* source select (see datasheet on how to change adc source) */
-	ctd->vmux &= 3;/* default vmux=1 */
-	/* pal-B */
-	cx_write(MO_INPUT_FORMAT, (ctd->vmux<<14)|(1<<13)|0x01|0x10|0x10000);
-	cx_write(MO_OUTPUT_FORMAT, 0x0f); /* allow full range */
-
-	cx_write(MO_CONTR_BRIGHT, 0xff00);
-
-	/* vbi lenght CLUSTER_BUFFER_SIZE/2  work */
-
-	/*
-	 * no of byte transferred from peripehral to fifo
-	 * if fifo buffer < this, it will still transfer this no of byte
-	 * must be multiple of 8, if not go haywire?
-	 */
-	cx_write(MO_VBI_PACKET, (((CLUSTER_BUFFER_SIZE)<<17)|(2<<11)));
-
-	/* raw mode & byte swap <<8 (3<<8=swap) */
-	cx_write(MO_COLOR_CTRL, ((0xe)|(0xe<<4)|(0<<8)));
-
-	/* capture 16 bit or 8 bit raw samples */
-	if (ctd->tenbit)
-		cx_write(MO_CAPTURE_CTRL, ((1<<6)|(3<<1)|(1<<5)));
-	else
-		cx_write(MO_CAPTURE_CTRL, ((1<<6)|(3<<1)|(0<<5)));
-
-	/* power down audio and chroma DAC+ADC */
-	cx_write(MO_AFECFG_IO, 0x12);
+	cxadc_init_hw(ctd);
+	if (ctd->audsel != -1)
+		cx_info("audsel = %d\n", ctd->audsel&3);
 
-	/* run risc */
-	cx_write(MO_DEV_CNTRL2, 1<<5);
-	/* enable fifo and risc */
-	cx_write(MO_VID_DMACNTRL, ((1<<7)|(1<<3)));
+	/* the DMA is started when the device is first opened */
 
 	rc = request_irq(ctd->irq, cxadc_irq, IRQF_SHARED, "cxadc", ctd);
 	if (rc < 0) {
@@ -1052,6 +3169,12 @@ static int cxadc_probe(struct pci_dev *pci_dev,
 		goto fail1x;
 	}
 
+	/* take the IRQ, and with it the reader wake-ups, on the card's node */
+	if (dev_to_node(&pci_dev->dev) != NUMA_NO_NODE) {
+		cx_info("numa node %d\n", dev_to_node(&pci_dev->dev));
+		irq_set_affinity_and_hint(ctd->irq, cpumask_of_node(dev_to_node(&pci_dev->dev)));
+	}
+
 	/* register devices */
 	cdev_init(&ctd->cdev, &cxadc_char_fops);
 	if (cdev_add(&ctd->cdev, MKDEV(cxadc_major, cxcount), 1)) {
@@ -1067,85 +3190,6 @@ static int cxadc_probe(struct pci_dev *pci_dev,
 
 	cx_info("char dev register ok\n");
 
-	if (ctd->tenxfsc < 10) {
-		//old code for old parameter compatibility
-		switch (ctd->tenxfsc) {
-		case 0:
-			/* clock speed equal to crystal speed, unmodified card = 28.6 mhz */
-			cx_write(MO_SCONV_REG, 131072); /* set SRC to 8xfsc */
-			cx_write(MO_PLL_REG, 0x11000000); /* set PLL to 1:1 */
-			break;
-		case 1:
-			/* clock speed equal to 1.25 x crystal speed, unmodified card = 35.8 mhz */
-			cx_write(MO_SCONV_REG, 131072*4/5); /* set SRC to 1.25x/10fsc */
-			cx_write(MO_PLL_REG, 0x01400000); /* set PLL to 1.25x/10fsc */
-			break;
-		case 2:
-			/* clock speed equal to ~1.4 x crystal speed, unmodified card = 40 mhz */
-			cx_write(MO_SCONV_REG, 131072*0.715909072483);
-			cx_write(MO_PLL_REG, 0x0165965A); /* 40000000.1406459 */
-			break;
-		default:
-			/* if someone sets value out of range, default to crystal speed */
-			/* clock speed equal to crystal speed, unmodified card = 28.6 mhz */
-			cx_write(MO_SCONV_REG, 131072); /* set SRC to 8xfsc */
-			cx_write(MO_PLL_REG, 0x11000000); /* set PLL to 1:1 */
-		}
-	} else {
-		if (ctd->tenxfsc < 100)
-			ctd->tenxfsc = ctd->tenxfsc * 1000000;  //if number 11-99, conver to 11,000,000 to 99,000,000
-		PLLint = ctd->tenxfsc/(ctd->crystal/40);  //always use PLL_PRE of 5 (=64)
-		longtenxfsc = (long)ctd->tenxfsc * 1000000;
-		longPLLboth = (long)(longtenxfsc/(long)(ctd->crystal/40));
-		longPLLint = (long)PLLint * 1000000;
-		PLLfrac = ((longPLLboth-longPLLint)*1048576)/1000000;
-		PLLfin =  ((PLLint+64)*1048576)+PLLfrac;
-		if (PLLfin < 81788928)
-			PLLfin = 81788928; // 81788928 lowest possible value
-		if (PLLfin > 119537664)
-			PLLfin = 119537664 ; //133169152 is highest possible value with PLL_PRE = 5 but above 119537664 may crash
-		cx_write(MO_PLL_REG,  PLLfin);
-		SConv = (long)(131072 * (long)ctd->crystal) / (long)ctd->tenxfsc;
-		cx_write(MO_SCONV_REG, SConv);
-	}
-
-
-
-	/* set vbi agc */
-	cx_write(MO_AGC_SYNC_SLICER, 0x0);
-
-	if (ctd->level < 0)
-		ctd->level = 0;
-	if (ctd->level > 31)
-		ctd->level = 31;
-
-	cx_write(MO_AGC_BACK_VBI, (0<<27)|(0<<26)|(1<<25)|(0x100<<16)|(0xfff<<0));
-	/* control gain also bit 16 */
-	cx_write(MO_AGC_GAIN_ADJ4, (ctd->sixdb<<23)|(0<<22)|(0<<21)|(ctd->level<<16)|(0xff<<8)|(0x0<<0));
-	/* for 'cooked' composite */
-	cx_write(MO_AGC_SYNC_TIP1, (0x1c0<<17)|(0x0<<9)|(0<<7)|(0xf<<0));
-	cx_write(MO_AGC_SYNC_TIP2, (0x20<<17)|(0x0<<9)|(0<<7)|(0xf<<0));
-	cx_write(MO_AGC_SYNC_TIP3, (0x1e48<<16)|(0xff<<8)|(ctd->center_offset));
-	cx_write(MO_AGC_GAIN_ADJ1, (0xe0<<17)|(0xe<<9)|(0x0<<7)|(0x7<<0));
-	cx_write(MO_AGC_GAIN_ADJ2, (0x20<<17)|(2<<7)|0x0f);
-	/* set gain of agc but not offset */
-	cx_write(MO_AGC_GAIN_ADJ3, (0x28<<16)|(0x28<<8)|(0x50<<0));
-
-	if (ctd->audsel != -1) {
-		/*
-		 * Pixelview PlayTVPro Ultracard specific
-		 * select which output is redirected to audio output jack
-		 * GPIO bit 3 is to enable 4052 , bit 0-1 4052's AB
-		 */
-		cx_write(MO_GP3_IO, 1<<25); /* use as 24 bit GPIO/GPOE */
-		cx_write(MO_GP1_IO, 0x0b);
-		cx_write(MO_GP0_IO, ctd->audsel&3);
-		cx_info("audsel = %d\n", ctd->audsel&3);
-	}
-
-	/* i2c sda/scl set to high and use software control */
-	cx_write(MO_I2C, 3);
-
 	/* hook into linked list */
 	ctd->next = cxadcs;
 	cxadcs = ctd;
@@ -1157,10 +3201,13 @@ static int cxadc_probe(struct pci_dev *pci_dev,
 	return 0;
 
 fail2:
+	irq_update_affinity_hint(ctd->irq, NULL);
 	free_irq(ctd->irq, ctd);
 fail1x:
-	free_dma_buffer(ctd);
-	free_risc_inst_buffer(ctd);
+	free_ring(ctd);
+	free_status_page(ctd);
+fail1t:
+	sysfs_remove_group(&pci_dev->dev.kobj, &mycxadc_stats_group);
 fail1s:
 	sysfs_remove_group(&pci_dev->dev.kobj, &mycxadc_group);
 fail1:
@@ -1203,18 +3250,23 @@ static void cxadc_remove(struct pci_dev *pci_dev)
 	struct cxadc *ctd = pci_get_drvdata(pci_dev);
 	/* struct cxadc *walk; */
 
+	cancel_delayed_work_sync(&ctd->stop_work);
 	disable_card(ctd);
+	cancel_work_sync(&ctd->levels_work);
+	cancel_work_sync(&ctd->cal_work);
 
 	/* removes our sysfs files */
+	sysfs_remove_group(&pci_dev->dev.kobj, &mycxadc_stats_group);
 	sysfs_remove_group(&pci_dev->dev.kobj, &mycxadc_group);
 	agc_reset(ctd);
 	device_destroy(cxadc_class, MKDEV(cxadc_major, ctd->cdev.dev));
 	cdev_del(&ctd->cdev);
 
 	/* free resources */
-	free_risc_inst_buffer(ctd);
+	irq_update_affinity_hint(ctd->irq, NULL);
 	free_irq(ctd->irq, ctd);
-	free_dma_buffer(ctd);
+	free_ring(ctd);
+	free_status_page(ctd);
 	iounmap(ctd->mmio);
 	release_mem_region(pci_resource_start(pci_dev, 0),
 			   pci_resource_len(pci_dev, 0));
@@ -1243,6 +3295,13 @@ static int cxadc_suspend(struct pci_dev *pci_dev, pm_message_t state)
 {
 	struct cxadc *ctd = pci_get_drvdata(pci_dev);
 
+	/* an idle card stays stopped after resume */
+	cancel_delayed_work_sync(&ctd->stop_work);
+	/* the timer would read the card's registers while it is powered down */
+	hrtimer_cancel(&ctd->poll_timer);
+	if (!ctd->users)
+		ctd->dma_running = false;
+
 	disable_card(ctd);
 	agc_reset(ctd);
 	pci_save_state(pci_dev);
@@ -1258,146 +3317,21 @@ static int cxadc_resume(struct pci_dev *pci_dev)
  * so re-init the hardware and re-sync our settings
  */
 	struct cxadc *ctd = pci_get_drvdata(pci_dev);
-	unsigned long longtenxfsc, longPLLboth, longPLLint;
-	int PLLint, PLLfrac, PLLfin, SConv, intstat, ret;
+	int ret;
 
 	ret = pci_enable_device(pci_dev);
 	pci_set_power_state(pci_dev, PCI_D0);
 	pci_restore_state(pci_dev);
-	/* init hw */
-	pci_set_master(pci_dev);
-	disable_card(ctd);
-
-	/* we use 16kbytes of FIFO buffer */
-	create_cdt_table(ctd, NUMBER_OF_CLUSTER_BUFFER, CLUSTER_BUFFER_SIZE,
-			CLUSTER_BUFFER_BASE, CDT_BASE);
-	/* size of one buffer in qword -1 */
-	cx_write(MO_DMA24_CNT1, (CLUSTER_BUFFER_SIZE/8-1));
-
-	/* ptr to cdt */
-	cx_write(MO_DMA24_PTR2, CDT_BASE);
-	/* size of cdt in qword */
-	cx_write(MO_DMA24_CNT2, 2*NUMBER_OF_CLUSTER_BUFFER);
-
-	/* clear interrupt */
-	intstat = cx_read(MO_VID_INTSTAT);
-	cx_write(MO_VID_INTSTAT, intstat);
-
-	cx_write(CHN24_CMDS_BASE, ctd->risc_inst_phy); /* working */
-	cx_write(CHN24_CMDS_BASE+4, CDT_BASE);
-	cx_write(CHN24_CMDS_BASE+8, 2*NUMBER_OF_CLUSTER_BUFFER);
-	cx_write(CHN24_CMDS_BASE+12, RISC_INST_QUEUE);
-
-	cx_write(CHN24_CMDS_BASE+16, 0x40);
-
-	/* source select (see datasheet on how to change adc source) */
-	ctd->vmux &= 3;/* default vmux=1 */
-	/* pal-B */
-	cx_write(MO_INPUT_FORMAT, (ctd->vmux<<14)|(1<<13)|0x01|0x10|0x10000);
-	cx_write(MO_OUTPUT_FORMAT, 0x0f); /* allow full range */
-
-	cx_write(MO_CONTR_BRIGHT, 0xff00);
-
-	/* vbi lenght CLUSTER_BUFFER_SIZE/2  work */
-
-	/*
-	 * no of byte transferred from peripehral to fifo
-	 * if fifo buffer < this, it will still transfer this no of byte
-	 * must be multiple of 8, if not go haywire?
-	 */
-	cx_write(MO_VBI_PACKET, (((CLUSTER_BUFFER_SIZE)<<17)|(2<<11)));
-
-	/* raw mode & byte swap <<8 (3<<8=swap) */
-	cx_write(MO_COLOR_CTRL, ((0xe)|(0xe<<4)|(0<<8)));
-
-	/* capture 16 bit or 8 bit raw samples */
-	if (ctd->tenbit)
-		cx_write(MO_CAPTURE_CTRL, ((1<<6)|(3<<1)|(1<<5)));
-	else
-		cx_write(MO_CAPTURE_CTRL, ((1<<6)|(3<<1)|(0<<5)));
-
-	/* power down audio and chroma DAC+ADC */
-	cx_write(MO_AFECFG_IO, 0x12);
-
-	/* run risc */
-	cx_write(MO_DEV_CNTRL2, 1<<5);
-	/* enable fifo and risc */
-	cx_write(MO_VID_DMACNTRL, ((1<<7)|(1<<3)));
-	if (ctd->tenxfsc < 10) {
-	//old code for old parameter compatibility
-		switch (ctd->tenxfsc) {
-		case 0:
-			/* clock speed equal to crystal speed, unmodified card = 28.6 mhz */
-			cx_write(MO_SCONV_REG, 131072); /* set SRC to 8xfsc */
-			cx_write(MO_PLL_REG, 0x11000000); /* set PLL to 1:1 */
-			break;
-		case 1:
-			/* clock speed equal to 1.25 x crystal speed, unmodified card = 35.8 mhz */
-			cx_write(MO_SCONV_REG, 131072*4/5); /* set SRC to 1.25x/10fsc */
-			cx_write(MO_PLL_REG, 0x01400000); /* set PLL to 1.25x/10fsc */
-			break;
-		case 2:
-			/* clock speed equal to ~1.4 x crystal speed, unmodified card = 40 mhz */
-			cx_write(MO_SCONV_REG, 131072*0.715909072483);
-			cx_write(MO_PLL_REG, 0x0165965A); /* 40000000.1406459 */
-			break;
-		default:
-			/* if someone sets value out of range, default to crystal speed */
-			/* clock speed equal to crystal speed, unmodified card = 28.6 mhz */
-			cx_write(MO_SCONV_REG, 131072); /* set SRC to 8xfsc */
-			cx_write(MO_PLL_REG, 0x11000000); /* set PLL to 1:1 */
-		}
-	} else {
-		if (ctd->tenxfsc < 100)
-			ctd->tenxfsc = ctd->tenxfsc * 1000000;  //if number 11-99, conver to 11,000,000 to 99,000,000
-		PLLint = ctd->tenxfsc/(ctd->crystal/40);  //always use PLL_PRE of 5 (=64)
-		longtenxfsc = (long)ctd->tenxfsc * 1000000;
-		longPLLboth = (long)(longtenxfsc/(long)(ctd->crystal/40));
-		longPLLint = (long)PLLint * 1000000;
-		PLLfrac = ((longPLLboth-longPLLint)*1048576)/1000000;
-		PLLfin =  ((PLLint+64)*1048576)+PLLfrac;
-		if (PLLfin < 81788928)
-			PLLfin = 81788928; // 81788928 lowest possible value
-		if (PLLfin > 119537664)
-			PLLfin = 119537664 ; //133169152 is highest possible value with PLL_PRE = 5 but above 119537664 may crash
-		cx_write(MO_PLL_REG,  PLLfin);
-		SConv = (long)(131072 * (long)ctd->crystal) / (long)ctd->tenxfsc;
-		cx_write(MO_SCONV_REG, SConv);
-	}
-
-	/* set vbi agc */
-	cx_write(MO_AGC_SYNC_SLICER, 0x0);
-
-	if (ctd->level < 0)
-		ctd->level = 0;
-	if (ctd->level > 31)
-		ctd->level = 31;
-
-	cx_write(MO_AGC_BACK_VBI, (0<<27)|(0<<26)|(1<<25)|(0x100<<16)|(0xfff<<0));
-	/* control gain also bit 16 */
-	cx_write(MO_AGC_GAIN_ADJ4, (ctd->sixdb<<23)|(0<<22)|(0<<21)|(ctd->level<<16)|(0xff<<8)|(0x0<<0));
-	/* for 'cooked' composite */
-	cx_write(MO_AGC_SYNC_TIP1, (0x1c0<<17)|(0x0<<9)|(0<<7)|(0xf<<0));
-	cx_write(MO_AGC_SYNC_TIP2, (0x20<<17)|(0x0<<9)|(0<<7)|(0xf<<0));
-	cx_write(MO_AGC_SYNC_TIP3, (0x1e48<<16)|(0xff<<8)|(ctd->center_offset));
-	cx_write(MO_AGC_GAIN_ADJ1, (0xe0<<17)|(0xe<<9)|(0x0<<7)|(0x7<<0));
-	cx_write(MO_AGC_GAIN_ADJ2, (0x20<<17)|(2<<7)|0x0f);
-	/* set gain of agc but not offset */
-	cx_write(MO_AGC_GAIN_ADJ3, (0x28<<16)|(0x28<<8)|(0x50<<0));
-
-	if (ctd->audsel != -1) {
-		/*
-		 * Pixelview PlayTVPro Ultracard specific
-		 * select which output is redirected to audio output jack
-		 * GPIO bit 3 is to enable 4052 , bit 0-1 4052's AB
-		 */
-		cx_write(MO_GP3_IO, 1<<25); /* use as 24 bit GPIO/GPOE */
-		cx_write(MO_GP1_IO, 0x0b);
-		cx_write(MO_GP0_IO, ctd->audsel&3);
+	mutex_lock(&ctd->lock);
+	cxadc_init_hw(ctd);
+	if (ctd->dma_running) {
+		cxadc_rewind(ctd);
+		cxadc_start_dma(ctd);
+		cx_write(MO_PCI_INTMSK, 1);
 	}
-
-	/* i2c sda/scl set to high and use software control */
-	cx_write(MO_I2C, 3);
+	if (ctd->users && ctd->poll_period)
+		hrtimer_start(&ctd->poll_timer, ctd->poll_period, HRTIMER_MODE_REL);
+	mutex_unlock(&ctd->lock);
 
 	ret = request_irq(ctd->irq, cxadc_irq, IRQF_SHARED, "cxadc", ctd);
 	cx_write(MO_VID_INTMSK, INTERRUPT_MASK);
@@ -0,0 +1,220 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * cxadc - userspace interface to /dev/cxadcN
+ *
+ * This header is shared between the driver and capture tools.
+ */
+
+#ifndef CXADC_H
+#define CXADC_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * mmap() layout: the device can be mapped read-only with MAP_SHARED.
+ * The first CXADC_MMAP_STATUS_PAGES pages of the mapping hold a
+ * struct cxadc_mmap_status, and the DMA ring follows immediately after.
+ * Where DMA may not be cache-coherent only the status pages can be mapped,
+ * on their own, and mapping the ring fails with ENODEV.
+ */
+#define CXADC_MMAP_STATUS_PAGES		1
+
+#define CXADC_MMAP_STATUS_VERSION	3
+
+/* number of entries in the IRQ timestamp log, a power of 2 */
+#define CXADC_TIMESTAMP_LOG_SIZE	64
+
+/*
+ * One IRQ timestamp. Entry seq lives in slot (seq - 1) % CXADC_TIMESTAMP_LOG_SIZE
+ * and is rewritten in place by the driver without locking: read seq, then the
+ * other fields, then seq again, and only trust the entry if both reads of
+ * seq match and are non-zero.
+ */
+struct cxadc_timestamp {
+	__u64 seq;		/* IRQ sequence number from 1, 0 while being written */
+	__u64 page;		/* pages completed when the IRQ was raised, counted like hw_pages */
+	__u64 time_ns;		/* CLOCK_BOOTTIME when the IRQ was handled */
+};
+
+struct cxadc_mmap_status {
+	__u32 version;		/* CXADC_MMAP_STATUS_VERSION */
+	__u32 page_size;	/* size of one DMA page in bytes */
+	__u32 ring_pages;	/* number of DMA pages in the ring */
+	/*
+	 * Index of the first DMA page that is not yet known to be complete;
+	 * pages before it (modulo ring_pages) hold valid data. -1 from the
+	 * (re)start of the capture until the card has finished its first
+	 * few pages.
+	 */
+	__s32 lgpcnt;
+
+	/* since version 2 */
+	__u32 irq_period_pages;	/* pages between IRQs, see irq_period_kb */
+	__u32 timestamp_log_size;	/* CXADC_TIMESTAMP_LOG_SIZE */
+	__u64 timestamp_seq;	/* seq of the newest entry in timestamps */
+	/*
+	 * Time at which each IRQ was handled. page % ring_pages is the lgpcnt
+	 * published by that IRQ.
+	 */
+	struct cxadc_timestamp timestamps[CXADC_TIMESTAMP_LOG_SIZE];
+
+	/* since version 3 */
+	/*
+	 * Pages completed since the DMA was first started, counted like
+	 * cxadc_timestamp.page; lgpcnt == hw_pages % ring_pages once lgpcnt
+	 * is not -1. Never goes backwards, but jumps forward to the next
+	 * multiple of ring_pages whenever the DMA is restarted.
+	 */
+	__u64 hw_pages;
+};
+
+/*
+ * Output sample formats, selected with
+ * /sys/class/cxadc/cxadcN/device/parameters/format (by name) and applied to
+ * each reader when it opens the device. All 16-bit formats are little-endian.
+ */
+enum cxadc_format {
+	CXADC_FORMAT_RAW,	/* "raw": as captured, u8, or u16 with the 10 bits in 15:6 (tenbit) */
+	CXADC_FORMAT_SIGNED,	/* "signed": s8, or s16 with the 10 bits in 15:6 (tenbit) */
+	CXADC_FORMAT_RJ16,	/* "rj16": tenbit only, u16 with the 10 bits in 9:0 */
+	/*
+	 * "packed10": tenbit only, 4 unsigned 10-bit samples in 5 bytes. Sample n
+	 * of a group is bits 10n+9:10n of the group read as a little-endian
+	 * 40-bit number.
+	 */
+	CXADC_FORMAT_PACKED10,
+};
+
+/*
+ * ioctls on /dev/cxadcN. The legacy gain ioctl 0x12345670 (gain passed
+ * directly as the argument) is still accepted.
+ */
+#define CXADC_IOC_MAGIC			0xCA
+
+/*
+ * Ring overruns seen by this file descriptor. If a reader falls more than
+ * a ring behind the card, the driver skips it forward to the newest data
+ * and counts the bytes that were lost. Device-wide totals are in
+ * /sys/class/cxadc/cxadcN/device/stats.
+ */
+struct cxadc_overruns {
+	__u64 overruns;		/* number of times the reader was skipped */
+	__u64 dropped_bytes;	/* total bytes skipped */
+};
+
+#define CXADC_IOC_GET_OVERRUNS		_IOR(CXADC_IOC_MAGIC, 1, struct cxadc_overruns)
+
+/*
+ * A consistent copy of the IRQ timestamp log from the status page. Entries
+ * that are unused or were being rewritten during the copy have seq 0.
+ */
+struct cxadc_timestamp_log {
+	__u64 seq;		/* seq of the newest entry */
+	struct cxadc_timestamp entries[CXADC_TIMESTAMP_LOG_SIZE];
+};
+
+#define CXADC_IOC_GET_TIMESTAMPS	_IOR(CXADC_IOC_MAGIC, 2, struct cxadc_timestamp_log)
+
+/* number of entries in the gain change log */
+#define CXADC_EVENT_LOG_SIZE		64
+
+/*
+ * A change of the gain or DC offset registers. The card captures in whole
+ * pages, so the position is only known to the page the card was filling when
+ * the registers were written: the change took effect somewhere in it.
+ */
+struct cxadc_event {
+	__u64 seq;		/* change number from 1, 0 for an unused entry */
+	__u64 page;		/* page being filled, counted like cxadc_timestamp */
+	__u64 time_ns;		/* CLOCK_BOOTTIME of the register write */
+	__u32 level;		/* new level, sixdb and center_offset */
+	__u32 sixdb;
+	__u32 center_offset;
+	__u32 reserved;
+};
+
+/* the last CXADC_EVENT_LOG_SIZE changes; entry seq is in slot (seq - 1) % size */
+struct cxadc_event_log {
+	__u64 seq;		/* seq of the newest entry */
+	struct cxadc_event entries[CXADC_EVENT_LOG_SIZE];
+};
+
+#define CXADC_IOC_GET_EVENTS		_IOR(CXADC_IOC_MAGIC, 4, struct cxadc_event_log)
+
+/* most cards CXADC_IOC_GROUP_START can start together */
+#define CXADC_GROUP_MAX			8
+
+/*
+ * Restart the capture on several cards at once, so that their streams start
+ * within a few microseconds of each other. Each card is stopped and its DMA
+ * rewound, then all of them are started back to back with interrupts off.
+ * The data every reader of these cards reads next begins at its card's
+ * restart, so nothing should be reading from them while the ioctl runs. Pass
+ * one fd per card. The ioctl can be issued on any /dev/cxadcN fd and does not
+ * need to include that fd.
+ */
+struct cxadc_group_start {
+	__u32 count;				/* in: number of entries in fds */
+	__u32 reserved;
+	__s32 fds[CXADC_GROUP_MAX];		/* in: open /dev/cxadcN fds, one per card */
+	__u64 start_ns[CXADC_GROUP_MAX];	/* out: CLOCK_BOOTTIME at each card's restart */
+	__u64 start_page[CXADC_GROUP_MAX];	/* out: page count of each card's restart, see cxadc_timestamp */
+};
+
+#define CXADC_IOC_GROUP_START		_IOWR(CXADC_IOC_MAGIC, 3, struct cxadc_group_start)
+
+/*
+ * 64-bit stream positions, counted in the card's own samples from when the
+ * DMA was first started, see hw_pages in struct cxadc_mmap_status. The
+ * read position is where this fd will next take data from the ring, so
+ * head_samples - read_samples is how far it is behind the card.
+ */
+struct cxadc_position {
+	__u64 head_bytes;	/* bytes the card has finished writing */
+	__u64 read_bytes;	/* this reader's position in the same count */
+	__u64 head_samples;	/* head_bytes / sample_size */
+	__u64 read_samples;	/* read_bytes / sample_size */
+	__u32 sample_size;	/* bytes per sample in the ring: 2 with tenbit, else 1 */
+	__u32 reserved;
+};
+
+#define CXADC_IOC_GET_POSITION		_IOR(CXADC_IOC_MAGIC, 5, struct cxadc_position)
+
+/*
+ * Start this reader's next read the given number of ring bytes before the
+ * card's head, rounded up to a whole page, so it gets samples captured
+ * before it asked for them. The reader can't go back further than the
+ * start of the current capture or about one ring less two IRQ periods;
+ * the value written back is how far back it actually went. 0 moves it to
+ * the newest data. Nothing else should read from the fd at the same time.
+ */
+#define CXADC_IOC_REWIND		_IOWR(CXADC_IOC_MAGIC, 6, __u64)
+
+/* number of bins in struct cxadc_levels */
+#define CXADC_LEVELS_BINS		16
+
+/*
+ * Level statistics of the newest IRQ period of samples, measured by the
+ * driver while /sys/class/cxadc/cxadcN/device/parameters/level_stats is
+ * set and the device is open. Sample values are 0 to 255, or 0 to 1023
+ * with tenbit.
+ */
+struct cxadc_levels {
+	__u64 seq;		/* number of blocks measured, 0 if none yet */
+	__u64 page;		/* first page of the block, counted like cxadc_timestamp */
+	__u64 skipped;		/* blocks not measured because the driver fell behind */
+	__u32 bits;		/* 8, or 10 with tenbit */
+	__u32 samples;		/* samples in the block */
+	__u64 sum;		/* sum of the samples, sum / samples is the mean */
+	__u32 min;
+	__u32 max;
+	__u32 clip_low;		/* samples at 0 */
+	__u32 clip_high;	/* samples at full scale */
+	/* samples by value, bin n counting values in [n, n + 1) * 2^bits / 16 */
+	__u32 hist[CXADC_LEVELS_BINS];
+};
+
+#define CXADC_IOC_GET_LEVELS		_IOR(CXADC_IOC_MAGIC, 7, struct cxadc_levels)
+
+#endif /* CXADC_H */
@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * cxadc tracepoints, for following samples from the card's IRQ to the
+ * reader with perf or ftrace:
+ *
+ *   perf record -e 'cxadc:*' -a
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cxadc
+
+#if !defined(CXADC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define CXADC_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* RISC IRQ1: gp_cnt is the rounded page counter, hw_pages the new head */
+TRACE_EVENT(cxadc_irq,
+	TP_PROTO(int minor, u32 status, int gp_cnt, u64 hw_pages),
+	TP_ARGS(minor, status, gp_cnt, hw_pages),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(u32, status)
+		__field(int, gp_cnt)
+		__field(u64, hw_pages)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->status = status;
+		__entry->gp_cnt = gp_cnt;
+		__entry->hw_pages = hw_pages;
+	),
+	TP_printk("cxadc%d status=0x%x gp_cnt=%d hw_pages=%llu",
+		__entry->minor, __entry->status, __entry->gp_cnt,
+		(unsigned long long)__entry->hw_pages)
+);
+
+/* a reader woke up after waiting for new pages */
+TRACE_EVENT(cxadc_wakeup,
+	TP_PROTO(int minor, u64 hw_pages, u64 pos),
+	TP_ARGS(minor, hw_pages, pos),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(u64, hw_pages)
+		__field(u64, pos)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->hw_pages = hw_pages;
+		__entry->pos = pos;
+	),
+	TP_printk("cxadc%d hw_pages=%llu pos=%llu",
+		__entry->minor, (unsigned long long)__entry->hw_pages,
+		(unsigned long long)__entry->pos)
+);
+
+/* len bytes copied to a reader out of absolute page number page */
+TRACE_EVENT(cxadc_copy,
+	TP_PROTO(int minor, u64 page, unsigned int len),
+	TP_ARGS(minor, page, len),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(u64, page)
+		__field(unsigned int, len)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->page = page;
+		__entry->len = len;
+	),
+	TP_printk("cxadc%d page=%llu len=%u",
+		__entry->minor, (unsigned long long)__entry->page, __entry->len)
+);
+
+DECLARE_EVENT_CLASS(cxadc_file,
+	TP_PROTO(int minor),
+	TP_ARGS(minor),
+	TP_STRUCT__entry(
+		__field(int, minor)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+	),
+	TP_printk("cxadc%d", __entry->minor)
+);
+
+DEFINE_EVENT(cxadc_file, cxadc_open,
+	TP_PROTO(int minor),
+	TP_ARGS(minor)
+);
+
+DEFINE_EVENT(cxadc_file, cxadc_release,
+	TP_PROTO(int minor),
+	TP_ARGS(minor)
+);
+
+#endif /* CXADC_TRACE_H */
+
+/* this part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE cxadc_trace
+#include <trace/define_trace.h>